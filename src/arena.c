@@ -0,0 +1,106 @@
+#include "arena.h"
+#include <stdarg.h>
+#include <string.h>
+
+static const gsize BLOCK_SIZE = 64 * 1024;
+static const gsize ALIGNMENT = 16; // enough for anything that's put in here
+
+/**
+ * Public procedures
+ */
+
+Arena *
+arena_new ()
+{
+  Arena *arena = g_slice_alloc0 (sizeof (Arena));
+  arena->blocks = g_ptr_array_new ();
+  return arena;
+}
+
+void
+arena_free (Arena *arena)
+{
+  for (guint idx = 0; idx < arena->blocks->len; ++idx)
+    g_free (g_ptr_array_index (arena->blocks, idx));
+  g_ptr_array_free (arena->blocks, TRUE);
+  g_slice_free1 (sizeof (Arena), arena);
+}
+
+void *
+arena_alloc (Arena *arena, gsize size)
+{
+  gsize start = (arena->used + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+  if (arena->block != NULL && start + size <= arena->size)
+  {
+    arena->used = start + size;
+    return arena->block + start;
+  }
+
+  if (size > BLOCK_SIZE / 4)
+  {
+    // the current block is kept, there might be plenty left in it
+    char *big = g_malloc (size);
+    g_ptr_array_add (arena->blocks, big);
+    return big;
+  }
+
+  arena->block = g_malloc (BLOCK_SIZE);
+  arena->size = BLOCK_SIZE;
+  arena->used = size;
+  g_ptr_array_add (arena->blocks, arena->block);
+  return arena->block;
+}
+
+void *
+arena_alloc0 (Arena *arena, gsize size)
+{
+  return memset (arena_alloc (arena, size), 0, size);
+}
+
+char *
+arena_strdup (Arena *arena, const char *str)
+{
+  gsize size = strlen (str) + 1;
+  return memcpy (arena_alloc (arena, size), str, size);
+}
+
+char *
+arena_strconcat (Arena *arena, const char *first, ...)
+{
+  va_list args;
+
+  gsize len = 0;
+  va_start (args, first);
+  for (const char *str = first; str != NULL; str = va_arg (args, const char *))
+    len += strlen (str);
+  va_end (args);
+
+  char *ret = arena_alloc (arena, len + 1);
+  char *out = ret;
+  va_start (args, first);
+  for (const char *str = first; str != NULL; str = va_arg (args, const char *))
+    out = stpcpy (out, str);
+  va_end (args);
+  *out = '\0';
+
+  return ret;
+}
+
+char *
+arena_printf (Arena *arena, const char *format, ...)
+{
+  va_list args;
+  va_list copy;
+
+  va_start (args, format);
+  va_copy (copy, args);
+  int len = vsnprintf (NULL, 0, format, copy);
+  va_end (copy);
+
+  g_assert (len >= 0);
+  char *ret = arena_alloc (arena, (gsize)len + 1);
+  vsnprintf (ret, (size_t)len + 1, format, args);
+  va_end (args);
+
+  return ret;
+}
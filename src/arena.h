@@ -0,0 +1,34 @@
+#ifndef OSX_KB_ARENA_H
+#define OSX_KB_ARENA_H
+
+#include "common.h"
+
+typedef struct _Arena Arena;
+
+/**
+ * Hands out memory from large blocks by bumping an offset, and frees all
+ * of it at once with arena_free. Nothing allocated from an arena can be
+ * freed or grown on its own; a request too big for a block gets a block to
+ * itself.
+ */
+
+struct _Arena
+{
+  char *block; // the one being handed out from
+  gsize used;
+  gsize size;
+
+  GPtrArray *blocks; // all of them, for freeing
+};
+
+Arena *arena_new (void);
+void arena_free (Arena *arena);
+
+void *arena_alloc (Arena *arena, gsize size);
+void *arena_alloc0 (Arena *arena, gsize size);
+
+char *arena_strdup (Arena *arena, const char *str);
+char *arena_strconcat (Arena *arena, const char *first, ...) G_GNUC_NULL_TERMINATED;
+char *arena_printf (Arena *arena, const char *format, ...) G_GNUC_PRINTF(2, 3);
+
+#endif
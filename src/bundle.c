@@ -5,6 +5,7 @@
 #include "util.h"
 
 typedef struct _KeyboardMeta KeyboardMeta;
+typedef struct _KeyboardJob KeyboardJob;
 
 struct _KeyboardMeta
 {
@@ -13,11 +14,23 @@ struct _KeyboardMeta
   const char *language;
   const char *icons_source;
 
-  GList *datafiles;
+  GPtrArray *datafiles; // made with the first one
   const char *base_encoding;
   bool osxopt;
   
   int capslock_policy;
+  bool delta_keymaps;
+  bool numeric_ids;
+  const char *id_map;
+};
+
+// each keyboard's step runs on its own, and its error is only looked at
+// once they've all finished
+
+struct _KeyboardJob
+{
+  Keyboard *kb;
+  GError *error;
 };
 
 static char *make_url (const char *base_url, const char *name);
@@ -32,6 +45,10 @@ static bool bundle_add_keyboard (Bundle *bundle, KeyboardMeta *meta, GError **er
 static bool bundle_config_keyboard (Bundle *bundle, KeyboardMeta *meta, const char *key, const char *value, GError **error);
 static bool bundle_config (Bundle *bundle, const char *key, const char *value, GError **error);
 
+static void load_keyboard (KeyboardJob *job, void *unused);
+static void write_keyboard (KeyboardJob *job, void *unused);
+static bool bundle_run_jobs (Bundle *bundle, GFunc func, GError **error);
+
 static bool bundle_write_keylayouts (Bundle *bundle, GError **error);
 static bool bundle_write_keyboard_info_plists (Bundle *bundle, Out *out, GError **error);
 static bool bundle_write_info_plist (Bundle *bundle, const char *path, GError **error);
@@ -118,9 +135,9 @@ bundle_add_keyboard (Bundle *bundle, KeyboardMeta *meta, GError **error)
   if (meta->name == NULL)
     meta->name = bundle->name;
 
-  for (GList *iter = bundle->keyboards; iter != NULL; iter = iter->next)
+  for (guint idx = 0; idx < bundle->keyboards->len; ++idx)
   {
-    Keyboard *kb = iter->data;
+    Keyboard *kb = g_ptr_array_index (bundle->keyboards, idx);
     if (strcmp (kb->name, meta->name) == 0)
       return make_error (error, "Duplicate keylayout file name `%s'", meta->name);
   }
@@ -128,6 +145,17 @@ bundle_add_keyboard (Bundle *bundle, KeyboardMeta *meta, GError **error)
   if (meta->datafiles == NULL)
     return make_error (error, "No datafile configured for %s keyboard", meta->name);
 
+  if (meta->id_map && !meta->numeric_ids)
+    return make_error (error, "An id-map for %s keyboard needs numeric-ids = true", meta->name);
+
+  // keyboards can be written at once, so two can't write the same file
+  for (guint idx = 0; meta->id_map && idx < bundle->keyboards->len; ++idx)
+  {
+    Keyboard *kb = g_ptr_array_index (bundle->keyboards, idx);
+    if (kb->id_map && strcmp (kb->id_map, meta->id_map) == 0)
+      return make_error (error, "Duplicate id-map file name `%s'", meta->id_map);
+  }
+
   size_t bundle_name_len = strlen (bundle->name);
   size_t kb_name_len = strlen (meta->name);
 
@@ -149,9 +177,12 @@ bundle_add_keyboard (Bundle *bundle, KeyboardMeta *meta, GError **error)
                                meta->datafiles,
                                meta->base_encoding,
                                meta->osxopt,
-                               meta->capslock_policy);
+                               meta->capslock_policy,
+                               meta->delta_keymaps,
+                               meta->numeric_ids,
+                               meta->id_map);
 
-  bundle->keyboards = g_list_append (bundle->keyboards, kb);
+  g_ptr_array_add (bundle->keyboards, kb);
 
   return true;
 }
@@ -159,7 +190,8 @@ bundle_add_keyboard (Bundle *bundle, KeyboardMeta *meta, GError **error)
 bool
 bundle_config_keyboard (Bundle *bundle, KeyboardMeta *meta, const char *key, const char *value, GError **error)
 {
-  // name, url, language, icons, datafile, base-encoding, osxopt, disable-on-capslock
+  // name, url, language, icons, datafile, base-encoding, osxopt, disable-on-capslock, delta-keymaps,
+  // numeric-ids, id-map
   if (strcmp (key, "name") == 0)
     meta->name = value;
   else if (strcmp (key, "language") == 0)
@@ -169,11 +201,21 @@ bundle_config_keyboard (Bundle *bundle, KeyboardMeta *meta, const char *key, con
   else if (strcmp (key, "osxopt") == 0)
     return parse_bool (&meta->osxopt, value, error);
   else if (strcmp (key, "datafile") == 0)
-    meta->datafiles = g_list_append (meta->datafiles, (char *)value);
+  {
+    if (meta->datafiles == NULL)
+      meta->datafiles = g_ptr_array_new ();
+    g_ptr_array_add (meta->datafiles, (char *)value);
+  }
   else if (strcmp (key, "capslock-policy") == 0)
     return parse_capslock_policy (&meta->capslock_policy, value, error);
   else if (strcmp (key, "icons") == 0)
     meta->icons_source = value;
+  else if (strcmp (key, "delta-keymaps") == 0)
+    return parse_bool (&meta->delta_keymaps, value, error);
+  else if (strcmp (key, "numeric-ids") == 0)
+    return parse_bool (&meta->numeric_ids, value, error);
+  else if (strcmp (key, "id-map") == 0)
+    meta->id_map = value;
 
   return true;
 }
@@ -195,25 +237,87 @@ bundle_config (Bundle *bundle, const char *key, const char *value, GError **erro
   return true;                   
 }
 
+void
+load_keyboard (KeyboardJob *job, void *unused)
+{
+  keyboard_load_data (job->kb, &job->error);
+}
+
+void
+write_keyboard (KeyboardJob *job, void *unused)
+{
+  if (keyboard_write_keylayout (job->kb, &job->error))
+    keyboard_release (job->kb);
+}
+
+/**
+ * Runs func for every keyboard, up to bundle->jobs of them at once.
+ * Keyboards share only keyboard.c's caches of base encodings and parsed
+ * datafiles. Each cache entry is written under its own lock, once, and is
+ * never changed after it has loaded; keyboards copy what they go on to
+ * change. So the results don't depend on how many jobs there are or the
+ * order they finish in, and the error reported is that of the first
+ * keyboard that failed, in configuration order. Run one at a time, it
+ * stops at the first failure.
+ */
 bool
-bundle_write_keylayouts (Bundle *bundle, GError **error)
+bundle_run_jobs (Bundle *bundle, GFunc func, GError **error)
 {
-  for (GList *iter = bundle->keyboards; iter != NULL; iter = iter->next)
+  guint n_jobs = bundle->keyboards->len;
+  KeyboardJob *jobs = g_new0 (KeyboardJob, n_jobs);
+  for (guint idx = 0; idx < n_jobs; ++idx)
+    jobs[idx].kb = g_ptr_array_index (bundle->keyboards, idx);
+
+  GThreadPool *pool = NULL;
+  if (bundle->jobs > 1 && n_jobs > 1)
+    pool = g_thread_pool_new (func, NULL, (gint)MIN (bundle->jobs, n_jobs), FALSE, NULL);
+
+  if (pool)
   {
-    Keyboard *kb = iter->data;
-    if (!keyboard_write_keylayout (kb, error))
-      return false;
+    for (guint idx = 0; idx < n_jobs; ++idx)
+      g_thread_pool_push (pool, &jobs[idx], NULL);
+
+    g_thread_pool_free (pool, FALSE, TRUE); // waits for all of them
+  }
+  else
+  {
+    for (guint idx = 0; idx < n_jobs; ++idx)
+    {
+      func (&jobs[idx], NULL);
+      if (jobs[idx].error)
+        break;
+    }
   }
 
-  return true;
+  bool ok = true;
+  for (guint idx = 0; idx < n_jobs; ++idx)
+  {
+    if (jobs[idx].error == NULL)
+      continue;
+
+    if (ok)
+      g_propagate_error (error, jobs[idx].error);
+    else
+      g_error_free (jobs[idx].error);
+    ok = false;
+  }
+  g_free (jobs);
+
+  return ok;
+}
+
+bool
+bundle_write_keylayouts (Bundle *bundle, GError **error)
+{
+  return bundle_run_jobs (bundle, (GFunc)write_keyboard, error);
 }
 
 bool
 bundle_write_keyboard_info_plists (Bundle *bundle, Out *out, GError **error)
 {
-  for (GList *iter = bundle->keyboards; iter != NULL; iter = iter->next)
+  for (guint idx = 0; idx < bundle->keyboards->len; ++idx)
   {
-    Keyboard *kb = iter->data;
+    Keyboard *kb = g_ptr_array_index (bundle->keyboards, idx);
     if (!keyboard_write_info_plist (kb, out, error))
       return false;
   }
@@ -265,9 +369,9 @@ bundle_write_info_plist (Bundle *bundle, const char *path, GError **error)
 bool
 bundle_copy_icons (Bundle *bundle, const char *path, GError **error)
 {
-  for (GList *iter = bundle->keyboards; iter != NULL; iter = iter->next)
+  for (guint idx = 0; idx < bundle->keyboards->len; ++idx)
   {
-    Keyboard *kb = iter->data;
+    Keyboard *kb = g_ptr_array_index (bundle->keyboards, idx);
     if (kb->icons_source)
     {
       char *icons_path = g_build_filename (path, kb->icons_basename, NULL);
@@ -282,9 +386,9 @@ bundle_copy_icons (Bundle *bundle, const char *path, GError **error)
 bool
 bundle_move_keylayouts (Bundle *bundle, const char *path, GError **error)
 {
-  for (GList *iter = bundle->keyboards; iter != NULL; iter = iter->next)
+  for (guint idx = 0; idx < bundle->keyboards->len; ++idx)
   {
-    Keyboard *kb = iter->data;
+    Keyboard *kb = g_ptr_array_index (bundle->keyboards, idx);
     char *full_path = g_build_filename (path, kb->keylayout_basename, NULL);
     if (!util_move_file (kb->keylayout_basename, full_path, error))
       return false;
@@ -298,13 +402,15 @@ bundle_move_keylayouts (Bundle *bundle, const char *path, GError **error)
  */
 
 Bundle *
-bundle_new (const char *config_file, GError **error)
+bundle_new (const char *config_file, guint jobs, GError **error)
 {
   char *data;
   if (!g_file_get_contents (config_file, &data, NULL, error))
     return NULL;
 
   Bundle *bundle = g_slice_alloc0 (sizeof (Bundle));
+  bundle->keyboards = g_ptr_array_new ();
+  bundle->jobs = jobs;
 
   KeyboardMeta kb_meta = { NULL, };
   bool on_keyboard = false;
@@ -445,14 +551,7 @@ bundle_new (const char *config_file, GError **error)
 bool
 bundle_load_data (Bundle *bundle, GError **error)
 {
-  for (GList *iter = bundle->keyboards; iter != NULL; iter = iter->next)
-  {
-    Keyboard *kb = iter->data;
-    if (!keyboard_load_data (kb, error))
-      return false;
-  }
-
-  return true;
+  return bundle_run_jobs (bundle, (GFunc)load_keyboard, error);
 }
 
 bool
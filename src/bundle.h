@@ -14,10 +14,11 @@ struct _Bundle
   char *bundle_name;     // with the extension (allows spaces and caps)
   char *url;             // uses lowercased and unspaced NAME
 
-  GList *keyboards;
+  GPtrArray *keyboards;
+  guint jobs;            // how many keyboards are built or written at once
 };
 
-Bundle *bundle_new (const char *config_file, GError **error);
+Bundle *bundle_new (const char *config_file, guint jobs, GError **error);
 
 bool bundle_load_data (Bundle *bundle, GError **error);
 bool bundle_write_bundle (Bundle *bundle, GError **error);
@@ -2,66 +2,95 @@
 #include <string.h>
 #include "util.h"
 
+static guint32 hash_name (const char *name, gsize len);
+
+/**
+ * Private procedures
+ */
+
+// mkascii picks the seed so that no two names share a slot in name_hash
+guint32
+hash_name (const char *name, gsize len)
+{
+  guint32 hash = NAME_HASH_SEED;
+  for (gsize idx = 0; idx < len; ++idx)
+    hash = (hash ^ (guint8)name[idx]) * 16777619u;
+  return hash ^ (hash >> 16);
+}
+
 /**
  * Public procedures
  */
 
-char *
-data_load (const char *data_name, GError **error)
+DataFile *
+data_open (const char *data_name, GError **error)
 {
-  char *data = NULL;
-  if (util_file_exists (data_name))
+  if (!util_file_exists (data_name))
   {
-    g_file_get_contents (data_name, &data, NULL, error);
+    make_error (error, "Unknown file: %s", data_name);
+    return NULL;
   }
-  else
+
+  GMappedFile *mapped = g_mapped_file_new (data_name, FALSE, error);
+  if (mapped == NULL)
+    return NULL;
+
+  DataFile *file = g_slice_alloc (sizeof (DataFile));
+  file->mapped = mapped;
+  file->len = g_mapped_file_get_length (mapped);
+  file->contents = file->len > 0 ? g_mapped_file_get_contents (mapped) : "";
+  return file;
+}
+
+void
+data_close (DataFile *file)
+{
+  g_mapped_file_unref (file->mapped);
+  g_slice_free1 (sizeof (DataFile), file);
+}
+
+const BuiltinKey *
+data_builtin_keys (const char *data_name, gsize *n_keys)
+{
+  if (strcmp (data_name, "ansi.qwerty") == 0)
+  {
+    *n_keys = G_N_ELEMENTS (ansi_qwerty_keys);
+    return ansi_qwerty_keys;
+  }
+  else if (strcmp (data_name, "ansi.dvorak") == 0)
   {
-    if (strcmp (data_name, "ansi.qwerty") == 0)
-      data = data_load_internal (KB_DATA_ANSI_QWERTY, error);
-    else if (strcmp (data_name, "ansi.dvorak") == 0)
-      data = data_load_internal (KB_DATA_ANSI_DVORAK, error);
-    else if (strcmp (data_name, "osxopt") == 0)
-      data = data_load_internal (KB_DATA_OSXOPT, error);
-    else
-      make_error (error, "Unknown file: %s", data_name);
+    *n_keys = G_N_ELEMENTS (ansi_dvorak_keys);
+    return ansi_dvorak_keys;
   }
-  return data;
+
+  return NULL;
 }
 
-char *
-data_load_internal (KbData data_id, GError **error)
+const BuiltinLine *
+data_builtin_lines (const char *data_name, gsize *n_lines)
 {
-  switch (data_id)
+  if (strcmp (data_name, "osxopt") == 0)
   {
-  case KB_DATA_OSXOPT:
-    return g_strdup ((const char *)osxopt);
-  case KB_DATA_ANSI_QWERTY:
-    return g_strdup ((const char *)ansi_qwerty);
-  case KB_DATA_ANSI_DVORAK:
-    return g_strdup ((const char *)ansi_dvorak);
+    *n_lines = G_N_ELEMENTS (osxopt_lines);
+    return osxopt_lines;
   }
-  g_assert_not_reached ();
+
   return NULL;
 }
 
 char
-lookup_ascii (const char *name)
+lookup_ascii (const char *name, gsize len)
 {
-  int low = 0;
-  int high = N_NAMES - 1;
-  while (low <= high)
-  {
-    int mid = (low + high) / 2;
-    int cmp = strcmp (name, name_to_ascii[mid].name);
-    if (cmp < 0)
-      high = mid - 1;
-    else if (cmp > 0)
-      low = mid + 1;
-    else
-      return name_to_ascii[mid].ascii;
-  }
+  // the only name that can be there; a name has at least one character
+  guint8 slot = name_hash[hash_name (name, len) & (G_N_ELEMENTS (name_hash) - 1)];
+  if (slot == 0)
+    return '\0';
+
+  const AsciiLookup *entry = &name_to_ascii[slot - 1];
+  if (entry->len != len || entry->name[0] != name[0] || memcmp (entry->name, name, len) != 0)
+    return '\0';
 
-  return '\0';
+  return entry->ascii;
 }
 
 const char *
@@ -1,15 +1,25 @@
 #include "keyboard.h"
-#include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 #include "data.h"
 #include "out.h"
+#include "scan.h"
 #include "util.h"
 
 typedef struct _Point Point;
 typedef struct _Literal Literal;
-typedef struct _Key Key;
 typedef struct _Action Action;
 typedef struct _Subaction Subaction;
+typedef struct _State State;
+typedef struct _Transition Transition;
+typedef struct _StateMachine StateMachine;
+typedef struct _SequenceNode SequenceNode;
+typedef struct _MappingKey MappingKey;
+typedef struct _Mapping Mapping;
+typedef struct _MappingFile MappingFile;
+typedef struct _ParsedLine ParsedLine;
+typedef struct _ParsedFile ParsedFile;
+typedef struct _BaseEncoding BaseEncoding;
 
 enum
   {
@@ -26,187 +36,416 @@ struct _Point
 struct _Literal // badly named :(
 {
   char *name; // this will be used to construct action names, it incorporates various substitutions
-  char *output; // also with substitutions, not the same ones
-  GList *points;
+  const char *output; // also with substitutions, not the same ones
+  Point *points; // in first_points until there are more than fit there
+  guint n_points;
+  guint capacity;
+  Point first_points[3]; // usually one key's shift states is all there is
+  guint index; // dense, for finding its actions
 };
 
-struct _Key
+struct _Action
+{
+  const char *name;
+  const char *id; // as written, the name unless ids are numeric
+  GArray *subactions; // of Subaction, by state number (by rank once minimized)
+};
+
+struct _Subaction
+{
+  State *state;
+  int action_type;
+  const char *output;
+  State *next;
+};
+
+/**
+ * A dead key state is the path of actions that leads to it from "none",
+ * which is state 0. States are made from the sequence trie, so following a
+ * sequence never builds a name; a state's readable name (its actions' names
+ * joined by ".") is only made when it's written, or ordered by, and then
+ * only once.
+ */
+
+struct _State
+{
+  guint32 number;
+  State *parent;
+  Action *action; // the one that leads here from parent
+
+  char *path; // the readable name, once made
+  char *id; // numeric, given out once states are merged
+  guint32 rank; // the order states are written in
+  State *same; // the state this was merged into, if any
+};
+
+// the dead key states, numbered, for finding the ones that behave the same
+
+struct _Transition
+{
+  guint32 state;
+  guint32 action;
+  guint32 action_type;
+  guint32 target; // the output's string id, or the next state's number
+};
+
+struct _StateMachine
+{
+  StrTable *outputs;
+  GArray *transitions;
+  GArray *terminators; // pairs of state number and output string id
+  guint32 n_actions;
+};
+
+/**
+ * Loading happens in two phases. Every mapping line, osxopt's first, goes
+ * into one trie of key sequences, and a later line for a sequence replaces
+ * an earlier one. Once they're all in, the trie is walked once, breadth
+ * first, to make the actions, states and terminators and to set the keymap
+ * results. The states are numbered in that walk, so their numbers only
+ * depend on the trie.
+ */
+
+struct _SequenceNode
 {
   int mods;
   Literal *literal;
+  const char *output; // from the last line that ends here, or NULL
+  guint32 output_line; // that line, counting through all the files in order; 0 for none
+  guint32 passed_line; // the last line that goes on past here, likewise
+  GHashTable *children; // by mods * n_literals + literal index, to node index
+  guint32 first_child; // node indices, in the order they were first seen; 0 is no node
+  guint32 last_child;
+  guint32 next_sibling;
 };
 
-struct _Action
+/**
+ * A datafile's lines are read once per run, however many keyboards use it:
+ * each output with its names replaced, and its keys still as text, since
+ * how they split into keys depends on the base encoding's literals. Its
+ * lines are then tokenized once for each base encoding that wants them,
+ * which only reads that base encoding's frozen tokenizer, so the datafiles
+ * are loaded on worker threads. Each keyboard merges the records into its
+ * trie one file after another, in the order they're configured in. None of
+ * this is ever freed, so the trie can point at the outputs.
+ */
+
+struct _ParsedLine
 {
-  const char *name;
-  GTree *subactions;
+  const char *output; // NULL on a line whose output couldn't be read
+  const char *keys; // the key fields, separated by single spaces
+  int lineno;
 };
 
-struct _Subaction
+struct _ParsedFile
 {
-  int action_type;
-  const char *target; // the output content or the next state
+  const char *data_name;
+  bool osxopt; // the built-in osxopt, whatever's on disk
+  GMutex lock; // held while it's being read
+  bool loaded;
+
+  Arena *arena; // NULL for built-in data
+  GArray *lines; // of ParsedLine, in file order, up to any error
+  GError *error; // after the last line, if it couldn't be read
+};
+
+struct _MappingKey
+{
+  int mods;
+  Literal *literal;
+};
+
+struct _Mapping
+{
+  const char *output;
+  guint first_key; // in the file's keys
+  guint n_keys;
+};
+
+struct _MappingFile
+{
+  Tokenizer *tokenizer; // the base encoding's
+  const char *data_name;
+  bool osxopt;
+  GMutex lock; // held while it's being tokenized
+  bool loaded;
+
+  GArray *mappings; // of Mapping, in file order
+  GArray *keys; // of MappingKey, for all the mappings in turn
+  GError *error; // if it couldn't be loaded
+};
+
+// every datafile read so far, kept for the whole run
+static GMutex parsed_files_lock;
+static GPtrArray *parsed_files;
+
+/**
+ * A base encoding is loaded once per run for each way it's read (only
+ * disabling capslock changes that), and keeps the datafiles tokenized
+ * against it. Once loaded it's never written to, so keyboards share its
+ * literals and tokenizer, and start from clones of its keymaps.
+ */
+
+struct _BaseEncoding
+{
+  const char *name;
+  bool capslock_disables;
+  GMutex lock; // held while it's being loaded
+
+  bool loaded;
+  GError *error; // if it couldn't be
+  Arena *arena;
+  StrTable *strings;
+  KeyMapSet *base_keymaps;
+  KeyMapSet *control_keymaps;
+  PrefixMap *literals;
+  Tokenizer *tokenizer;
+  guint n_literals;
+  bool active_capslock;
+
+  GPtrArray *mapping_files; // of MappingFile, once some keyboard has wanted them
 };
 
+// every base encoding loaded so far, kept for the whole run
+static GMutex base_encodings_lock;
+static GPtrArray *base_encodings;
+
 /** private procedures */
 
-static Point *point_new (int shift_state, int code);
-static Literal *literal_new (const char *literal);
-static void literal_add_point (Literal *literal, int shift_state, int code);
+static Literal *literal_new (const char *literal, const char *output, guint index, Arena *arena);
+static void literal_add_point (Literal *literal, int shift_state, int code, Arena *arena);
+
+static Action *action_new (const char *name, const char *id, Arena *arena);
+static void action_set_subaction (Action *action, State *state, const char *output, State *next);
 
-static Key *key_new (int mods, Literal *literal);
+static State *state_new (Keyboard *kb, State *parent, Action *action);
+static const char *state_path (Keyboard *kb, State *state);
+static const char *state_id (Keyboard *kb, State *state);
+static int compare_state_numbers (const State *lhs, const State *rhs);
+static int compare_state_ranks (const State *lhs, const State *rhs);
+static int compare_state_paths (const void *lhs, const void *rhs);
+static int compare_subaction_ranks (const void *lhs, const void *rhs);
+static int compare_action_names (const void *lhs, const void *rhs);
 
-static Action *action_new (const char *name);
-static Subaction *subaction_new (int action_type, const char *target);
-static void action_handle_state (Action *action, const char *state, int action_type, const char *target, Keyboard *kb);
+static bool parse_input_to_literal (const char *input, gsize len, GString *literal, GError **error);
 
-static bool parse_input_to_literal (char *token, GError **error);
+static char *parse_literal_to_name (const char *literal, Arena *arena);
+static char *parse_literal_to_output (const char *literal, Arena *arena);
 
-static char *parse_literal_to_name (const char *literal);
-static char *parse_literal_to_output (const char *literal);
+static ParsedFile *parsed_file_get (const char *data_name, bool osxopt);
+static bool parsed_file_parse (ParsedFile *file, DataFile *data, GError **error);
 
-static void keyboard_set_capslock_active (Keyboard *kb);
+static bool mapping_file_parse_keys (MappingFile *file, const char *start, const char *end, GError **error);
+static bool mapping_file_tokenize (MappingFile *file, ParsedFile *parsed, GError **error);
+static void mapping_file_load (MappingFile *file, void *unused);
+static void mapping_files_load (MappingFile **files, guint n_files);
+
+static BaseEncoding *base_encoding_get (const char *name, bool capslock_disables, GError **error);
+static MappingFile *base_encoding_mapping_file (BaseEncoding *base, const char *data_name, bool osxopt);
+static void base_encoding_start (BaseEncoding *base);
+static void base_encoding_add_field (BaseEncoding *base, GHashTable *literals, GPtrArray *tokens, int code, int shift_state,
+                                     const char *token, const char *output, const char *control);
+static void base_encoding_finish (BaseEncoding *base, GHashTable *literals, GPtrArray *tokens);
+static bool base_encoding_load (BaseEncoding *base, DataFile *data, GError **error);
+static void base_encoding_load_builtin (BaseEncoding *base, const BuiltinKey *keys, gsize n_keys);
+static void base_encoding_set_capslock_active (BaseEncoding *base);
 
 static bool keyboard_write_actions (Keyboard *kb, Out *out, GError **error);
 static bool keyboard_write_terminators (Keyboard *kb, Out *out, GError **error);
+static bool keyboard_write_id_map (Keyboard *kb, GError **error);
 
-static void keyboard_set_terminator (Keyboard *kb, const char *state, const char *terminator);
-static bool keyboard_parse_keys (Keyboard *kb, char *start, GList **keys, GError **error);
-static bool keyboard_load_sequence (Keyboard *kb, GList *keys, const char *output, GError **error);
+static void keyboard_set_terminator (Keyboard *kb, State *state, const char *terminator);
+static void keyboard_rank_states (Keyboard *kb);
+static void keyboard_minimize_states (Keyboard *kb);
+static void keyboard_number_states (Keyboard *kb);
+static guint32 keyboard_sequence_child (Keyboard *kb, guint32 parent, int mods, Literal *literal);
+static void keyboard_merge_mappings (Keyboard *kb, MappingFile *file, guint32 *line);
+static void keyboard_set_key_results (Keyboard *kb, int mods, Literal *literal, int result_type, const char *content);
+static Action *keyboard_key_action (Keyboard *kb, int mods, Literal *literal);
+static void keyboard_build_sequences (Keyboard *kb);
 
-static bool keyboard_set_base_encoding (Keyboard *kb, const char *data_name, char *data, char *osxalt, GError **error);
-static bool keyboard_load_mappings (Keyboard *kb, const char *data_name, char *data, GError **error);
+static void keyboard_set_base_encoding (Keyboard *kb, BaseEncoding *base);
 
 /**
  * Private procedures
  */
 
-Point *
-point_new (int shift_state, int code)
-{
-  Point *point = g_slice_alloc (sizeof (Point));
-  point->shift_state = shift_state;
-  point->code = code;
-  return point;
-}
-
+// the output is worked out from the literal unless it's given
 Literal *
-literal_new (const char *literal)
+literal_new (const char *literal, const char *output, guint index, Arena *arena)
 {
-  Literal *lit = g_slice_alloc (sizeof (Literal));
-  lit->name = parse_literal_to_name (literal);
-  lit->output = parse_literal_to_output (literal);
-  lit->points = NULL;
+  Literal *lit = arena_alloc (arena, sizeof (Literal));
+  lit->name = parse_literal_to_name (literal, arena);
+  lit->output = output ? output : parse_literal_to_output (literal, arena);
+  lit->points = lit->first_points;
+  lit->n_points = 0;
+  lit->capacity = G_N_ELEMENTS (lit->first_points);
+  lit->index = index;
   return lit;
 }
 
 void
-literal_add_point (Literal *literal, int shift_state, int code)
+literal_add_point (Literal *literal, int shift_state, int code, Arena *arena)
 {
-  Point *point = point_new (shift_state, code);
-  literal->points = g_list_append (literal->points, point);
-}
+  if (literal->n_points == literal->capacity)
+  {
+    // the outgrown points stay in the arena
+    literal->capacity *= 2;
+    Point *points = arena_alloc (arena, literal->capacity * sizeof (Point));
+    memcpy (points, literal->points, literal->n_points * sizeof (Point));
+    literal->points = points;
+  }
 
-Key *
-key_new (int mods, Literal *literal)
-{
-  Key *key = g_slice_alloc (sizeof (Key));
-  key->mods = mods;
-  key->literal = literal;
-  return key;
+  Point *point = &literal->points[literal->n_points];
+  point->shift_state = shift_state;
+  point->code = code;
+  literal->n_points += 1;
 }
 
 Action *
-action_new (const char *name)
+action_new (const char *name, const char *id, Arena *arena)
 {
-  Action *action = g_slice_alloc (sizeof (Action));
+  Action *action = arena_alloc (arena, sizeof (Action));
   action->name = name;
-  action->subactions = g_tree_new ((GCompareFunc)strcmp);
+  action->id = id;
+  action->subactions = g_array_new (FALSE, FALSE, sizeof (Subaction));
   return action;
 }
 
-Subaction *
-subaction_new (int action_type, const char *target)
-{
-  Subaction *sub = g_slice_alloc (sizeof (Subaction));
-  sub->action_type = action_type;
-  sub->target = target;
-  return sub;
-}
-
+/**
+ * Exactly one of output and next is given. The trie walk sets each state's
+ * subaction at most once, in state order, except that the one for "none"
+ * is made with the action and may then be replaced.
+ */
 void
-action_handle_state (Action *action, const char *state, int action_type, const char *target, Keyboard *kb)
+action_set_subaction (Action *action, State *state, const char *output, State *next)
 {
-  Subaction *subaction = g_tree_lookup (action->subactions, state);
-  if (subaction)
+  Subaction subaction;
+  subaction.state = state;
+  subaction.action_type = next ? ACTION_CHANGE_STATE : ACTION_OUTPUT;
+  subaction.output = output;
+  subaction.next = next;
+
+  guint len = action->subactions->len;
+  if (len > 0)
   {
-    if (subaction->action_type == action_type)
-    {
-      if (action_type == ACTION_OUTPUT)
-        subaction->target = target;
-      else
-        g_assert (strcmp (subaction->target, target) == 0);
-    }
-    else if (action_type == ACTION_OUTPUT)
-    {
-      keyboard_set_terminator (kb, subaction->target, target);
-    }
-    else
+    Subaction *last = &g_array_index (action->subactions, Subaction, len - 1);
+    if (last->state == state)
     {
-      keyboard_set_terminator (kb, target, subaction->target);
-      subaction->action_type = ACTION_CHANGE_STATE;
-      subaction->target = target;
+      *last = subaction;
+      return;
     }
+    g_assert (last->state->number < state->number);
   }
-  else
+
+  g_array_append_val (action->subactions, subaction);
+}
+
+State *
+state_new (Keyboard *kb, State *parent, Action *action)
+{
+  State *state = arena_alloc0 (kb->arena, sizeof (State));
+  state->number = kb->states->len;
+  state->parent = parent;
+  state->action = action;
+  g_ptr_array_add (kb->states, state);
+  return state;
+}
+
+const char *
+state_path (Keyboard *kb, State *state)
+{
+  if (state->path == NULL)
   {
-    subaction = subaction_new (action_type, target);
-    g_tree_insert (action->subactions, (char *)state, subaction);
+    if (state->parent == NULL)
+      state->path = arena_strdup (kb->arena, "none");
+    else if (state->parent->parent == NULL)
+      state->path = arena_strdup (kb->arena, state->action->name);
+    else
+      state->path = arena_strconcat (kb->arena, state_path (kb, state->parent), ".", state->action->name, NULL);
   }
+
+  return state->path;
+}
+
+const char *
+state_id (Keyboard *kb, State *state)
+{
+  if (!kb->numeric_ids || state->parent == NULL)
+    return state_path (kb, state);
+
+  g_assert (state->id != NULL); // only the states that are written have them
+  return state->id;
+}
+
+int
+compare_state_numbers (const State *lhs, const State *rhs)
+{
+  return (lhs->number > rhs->number) - (lhs->number < rhs->number);
+}
+
+int
+compare_state_ranks (const State *lhs, const State *rhs)
+{
+  return (lhs->rank > rhs->rank) - (lhs->rank < rhs->rank);
+}
+
+// for sorting State pointers, once their paths have been made
+int
+compare_state_paths (const void *lhs, const void *rhs)
+{
+  const State *lhs_state = *(State *const *)lhs;
+  const State *rhs_state = *(State *const *)rhs;
+  int cmp = strcmp (lhs_state->path, rhs_state->path);
+  return cmp != 0 ? cmp : compare_state_numbers (lhs_state, rhs_state);
+}
+
+int
+compare_subaction_ranks (const void *lhs, const void *rhs)
+{
+  return compare_state_ranks (((const Subaction *)lhs)->state, ((const Subaction *)rhs)->state);
+}
+
+// for sorting Action pointers
+int
+compare_action_names (const void *lhs, const void *rhs)
+{
+  return strcmp ((*(Action *const *)lhs)->name, (*(Action *const *)rhs)->name);
 }
 
+// input is a field of a datafile, literal gets it with the [NAME]s replaced
 bool
-parse_input_to_literal (char *token, GError **error)
+parse_input_to_literal (const char *input, gsize len, GString *literal, GError **error)
 {
-  char *ptr = token;
-  char *out = NULL;
-  char *end;
-  while (*ptr)
+  g_string_truncate (literal, 0);
+
+  const char *ptr = input;
+  const char *end = input + len;
+  while (ptr < end)
   {
-    if (*ptr == '[' && (end = strchr (ptr, ']')) != NULL)
+    const char *close;
+    if (*ptr == '[' && (close = memchr (ptr, ']', (size_t)(end - ptr))) != NULL)
     {
-      if (out == NULL)
-        out = ptr;
       ++ptr;
-      *end = '\0';
-
-      char ascii = lookup_ascii (ptr);
+      char ascii = lookup_ascii (ptr, (gsize)(close - ptr));
       if (ascii == '\0')
-        return make_error (error, "Unknown character name `%s'", ptr);
+        return make_error (error, "Unknown character name `%.*s'", (int)(close - ptr), ptr);
 
-      *out = ascii;
-      ++out;
-      ptr = end + 1;
+      g_string_append_c (literal, ascii);
+      ptr = close + 1;
     }
     else
     {
-      if (out)
-      {
-        *out = *ptr;
-        ++out;
-      }
+      g_string_append_c (literal, *ptr);
       ++ptr;
     }
   }
 
-  if (out)
-    *out = '\0';
-
   return true;
 }
 
 char *
-parse_literal_to_name (const char *literal)
+parse_literal_to_name (const char *literal, Arena *arena)
 {
   // two passes, once for length, second time for copying
 
@@ -223,7 +462,7 @@ parse_literal_to_name (const char *literal)
     ++ptr;
   }
 
-  ret = g_malloc (len + 1);
+  ret = arena_alloc (arena, len + 1);
   ptr = literal;
   char *out = ret;
   while (*ptr)
@@ -249,7 +488,7 @@ parse_literal_to_name (const char *literal)
 }
 
 char *
-parse_literal_to_output (const char *literal)
+parse_literal_to_output (const char *literal, Arena *arena)
 {
   // two passes, once for length, second time for copying
 
@@ -266,7 +505,7 @@ parse_literal_to_output (const char *literal)
     ++ptr;
   }
 
-  ret = g_malloc (len + 1);
+  ret = arena_alloc (arena, len + 1);
   ptr = literal;
   char *out = ret;
   while (*ptr)
@@ -289,90 +528,314 @@ parse_literal_to_output (const char *literal)
   return ret;
 }
 
-static gboolean
-write_subaction (const char *state, Subaction *subaction, void *userdata)
+// reads it the first time it's asked for, and waits for that if another
+// thread's doing it
+ParsedFile *
+parsed_file_get (const char *data_name, bool osxopt)
 {
-  struct
+  ParsedFile *file = NULL;
+
+  g_mutex_lock (&parsed_files_lock);
+  if (parsed_files == NULL)
+    parsed_files = g_ptr_array_new ();
+  for (guint idx = 0; idx < parsed_files->len && file == NULL; ++idx)
   {
-    Out *out;
-    GError **error;
-  } *data = userdata;
+    ParsedFile *cached = g_ptr_array_index (parsed_files, idx);
+    if (strcmp (cached->data_name, data_name) == 0 && cached->osxopt == osxopt)
+      file = cached;
+  }
+  if (file == NULL)
+  {
+    file = g_slice_alloc0 (sizeof (ParsedFile));
+    file->data_name = data_name;
+    file->osxopt = osxopt;
+    g_mutex_init (&file->lock);
+    g_ptr_array_add (parsed_files, file);
+  }
+  g_mutex_unlock (&parsed_files_lock);
+
+  g_mutex_lock (&file->lock);
+  if (!file->loaded)
+  {
+    file->lines = g_array_new (FALSE, FALSE, sizeof (ParsedLine));
+
+    // osxopt's built in, and so is anything else without a file of its name
+    gsize n_lines = 0;
+    const BuiltinLine *lines = osxopt ? data_builtin_lines ("osxopt", &n_lines)
+      : util_file_exists (data_name) ? NULL : data_builtin_lines (data_name, &n_lines);
+    if (lines)
+    {
+      for (gsize idx = 0; idx < n_lines; ++idx)
+      {
+        ParsedLine line = { lines[idx].output, lines[idx].keys, lines[idx].lineno };
+        g_array_append_val (file->lines, line);
+      }
+    }
+    else
+    {
+      file->arena = arena_new ();
+      DataFile *data = data_open (data_name, &file->error);
+      if (data)
+      {
+        parsed_file_parse (file, data, &file->error);
+        data_close (data);
+      }
+    }
+    file->loaded = true;
+  }
+  g_mutex_unlock (&file->lock);
+
+  return file;
+}
 
-  if (strcmp (state, "none") != 0)
+bool
+parsed_file_parse (ParsedFile *file, DataFile *data, GError **error)
+{
+  const char *data_name = file->data_name;
+  GString *literal = g_string_new (NULL); // each output, once its names are replaced
+  GString *keys = g_string_new (NULL);
+  int lineno = 1;
+  bool ok = false;
+  
+  const char *ptr = data->contents;
+  const char *end = ptr + data->len;
+  while (true)
   {
-    if (!out_printf (data->out, data->error,
-                     "      <when state=\"%s\" %s=\"%s\" />\n",
-                     state,
-                     subaction->action_type == ACTION_OUTPUT ? "output" : "next",
-                     subaction->target))
-      return TRUE;
+    ptr = scan_spaces (ptr, end, &lineno);
+    if (ptr == end)
+      break;
+
+    const char *output = ptr;
+    ptr = scan_field_end (ptr, end);
+    gsize output_len = (gsize)(ptr - output);
+
+    if (ptr == output)
+    {
+      make_error (error, "Missing output (did you mean SPC?): %s, line %d", data_name, lineno);
+      goto done;
+    }
+    if (ptr == end)
+    {
+      make_error (error, "Unexpected end of file: %s, line %d", data_name, lineno);
+      goto done;
+    }
+    if (*ptr == '\n')
+    {
+      make_error (error, "Unexpected end of line: %s, line %d", data_name, lineno);
+      goto done;
+    }
+
+    ++ptr;
+
+    ptr = scan_blanks (ptr, end);
+    if (ptr < end && *ptr == '\n')
+    {
+      make_error (error, "Unexpected end of line: %s, line %d", data_name, lineno);
+      goto done;
+    }
+    if (ptr == end)
+    {
+      make_error (error, "Unexpected end of file: %s, line %d", data_name, lineno);
+      goto done;
+    }
+
+    // now at the start of the key sequence to produce the output
+    // and we know there's SOMETHING at least
+    ParsedLine line;
+    line.lineno = lineno;
+    g_string_truncate (keys, 0);
+    bool done_line = false;
+    while (!done_line)
+    {
+      const char *start = ptr;
+      ptr = scan_field_end (ptr, end);
+      if (keys->len > 0)
+        g_string_append_c (keys, ' ');
+      g_string_append_len (keys, start, ptr - start);
+
+      ptr = scan_blanks (ptr, end);
+      if (ptr < end && *ptr == '\n')
+      {
+        done_line = true;
+        ++lineno;
+        ++ptr;
+      }
+
+      if (ptr == end)
+        done_line = true; // the last line needn't end in a newline
+    }
+    line.keys = arena_strdup (file->arena, keys->str);
+
+    // a bad key comes before a bad output on the same line, and keys are
+    // only looked at once the file's tokenized, so the line's still kept
+    bool output_ok = parse_input_to_literal (output, output_len, literal, error);
+    line.output = output_ok ? parse_literal_to_output (literal->str, file->arena) : NULL;
+    g_array_append_val (file->lines, line);
+    if (!output_ok)
+      goto done;
   }
 
-  return FALSE;
+  ok = true;
+
+ done:
+  g_string_free (keys, TRUE);
+  g_string_free (literal, TRUE);
+  
+  return ok;
 }
 
-static gboolean
-write_action (const char *name, Action *action, void *userdata)
+bool
+mapping_file_parse_keys (MappingFile *file, const char *start, const char *end, GError **error)
 {
-  struct
+  /**
+   * Each element can have one or two prefixed modifiers (O-, G-, C-) and
+   * then the representation of a key. There can be multiple keys in
+   * sequence, but the input has already been split on spaces.
+   */
+
+  const char *ptr = start;
+  while (ptr < end)
   {
-    Out *out;
-    GError **error;
-  } *data = userdata;
+    MappingKey key;
+    if (!tokenizer_next (file->tokenizer, &ptr, end, &key.mods, (void **)&key.literal, error))
+      return false;
 
-  if (!out_printf (data->out, data->error,
-                   "    <action id=\"%s\">\n",
-                   name))
-    return TRUE; // to stop the iteration
+    g_array_append_val (file->keys, key);
+  }
+
+  return true;
+}
 
-  Subaction *subaction = g_tree_lookup (action->subactions, "none");
-  if (subaction)
+// only reads the tokenizer, so any number of these can run at once; the
+// first error is the first one in the file, whichever stage found it
+bool
+mapping_file_tokenize (MappingFile *file, ParsedFile *parsed, GError **error)
+{
+  for (guint idx = 0; idx < parsed->lines->len; ++idx)
   {
-    if (!out_printf (data->out, data->error,
-                     "      <when state=\"none\" %s=\"%s\" />\n",
-                     subaction->action_type == ACTION_OUTPUT ? "output" : "next",
-                     subaction->target))
-      return TRUE;
+    ParsedLine *line = &g_array_index (parsed->lines, ParsedLine, idx);
+
+    Mapping mapping;
+    mapping.output = line->output;
+    mapping.first_key = file->keys->len;
+
+    const char *ptr = line->keys;
+    while (*ptr)
+    {
+      const char *start = ptr;
+      const char *space = strchr (ptr, ' ');
+      ptr = space ? space : start + strlen (start);
+
+      if (!mapping_file_parse_keys (file, start, ptr, error))
+        return suffix_error (error, "%s, line %d", file->data_name, line->lineno);
+
+      if (*ptr == ' ')
+        ++ptr;
+    }
+    mapping.n_keys = file->keys->len - mapping.first_key;
+
+    if (mapping.output)
+      g_array_append_val (file->mappings, mapping);
   }
 
-  g_tree_foreach (action->subactions, (GTraverseFunc)write_subaction, userdata);
-  if (*data->error)
-    return TRUE;
+  if (parsed->error)
+  {
+    g_propagate_error (error, g_error_copy (parsed->error));
+    return false;
+  }
 
-  if (!out_print (data->out, data->error, "    </action>\n"))
-    return TRUE;
+  return true;
+}
 
-  return FALSE;
+// run on a worker thread, so any error is kept for the merge to report
+void
+mapping_file_load (MappingFile *file, void *unused)
+{
+  g_mutex_lock (&file->lock);
+  if (!file->loaded)
+  {
+    ParsedFile *parsed = parsed_file_get (file->data_name, file->osxopt);
+    mapping_file_tokenize (file, parsed, &file->error);
+    file->loaded = true;
+  }
+  g_mutex_unlock (&file->lock);
 }
 
 void
-keyboard_set_capslock_active (Keyboard *kb)
+mapping_files_load (MappingFile **files, guint n_files)
+{
+  GThreadPool *pool = NULL;
+  if (n_files > 1)
+    pool = g_thread_pool_new ((GFunc)mapping_file_load, NULL, (gint)MIN (n_files, g_get_num_processors ()), FALSE, NULL);
+
+  if (pool == NULL)
+  {
+    for (guint idx = 0; idx < n_files; ++idx)
+      mapping_file_load (files[idx], NULL);
+    return;
+  }
+
+  for (guint idx = 0; idx < n_files; ++idx)
+    g_thread_pool_push (pool, files[idx], NULL);
+
+  g_thread_pool_free (pool, FALSE, TRUE); // waits for all of them
+}
+
+static bool
+write_when (Keyboard *kb, Out *out, GError **error, State *state, Subaction *subaction)
+{
+  if (subaction->action_type == ACTION_OUTPUT)
+  {
+    return out_printf (out, error,
+                       "      <when state=\"%s\" output=\"%s\" />\n",
+                       state_id (kb, state), subaction->output);
+  }
+  else
+  {
+    return out_printf (out, error,
+                       "      <when state=\"%s\" next=\"%s\" />\n",
+                       state_id (kb, state), state_id (kb, subaction->next));
+  }
+}
+
+static bool
+write_action (Keyboard *kb, Out *out, GError **error, Action *action)
 {
-  g_assert (kb->capslock_policy != CAPSLOCK_DISABLES);
-  kb->active_capslock = true;
-  key_map_set_set_capslock_active (kb->base_keymaps);
-  key_map_set_set_capslock_active (kb->control_keymaps);
+  if (!out_printf (out, error,
+                   "    <action id=\"%s\">\n",
+                   action->id))
+    return false;
+
+  // in rank order, so "none" comes first
+  for (guint idx = 0; idx < action->subactions->len; ++idx)
+  {
+    Subaction *subaction = &g_array_index (action->subactions, Subaction, idx);
+    if (!write_when (kb, out, error, subaction->state, subaction))
+      return false;
+  }
+
+  return out_print (out, error, "    </action>\n");
 }
 
 bool
 keyboard_write_actions (Keyboard *kb, Out *out, GError **error)
 {
-  if (g_tree_nnodes (kb->actions) > 0)
+  guint n_actions = kb->action_list->len;
+  if (n_actions > 0)
   {
     if (!out_print (out, error, "  <actions>\n"))
       return false;
 
-    struct
-    {
-      Out *out;
-      GError **error;
-    } data = { out, error };
-    g_tree_foreach (kb->actions, (GTraverseFunc)write_action, &data);
+    Action **order = g_new (Action *, n_actions);
+    memcpy (order, kb->action_list->pdata, n_actions * sizeof (Action *));
+    qsort (order, n_actions, sizeof (Action *), compare_action_names);
 
-    if (*error)
-      return false;
+    bool ok = true;
+    for (guint idx = 0; idx < n_actions && ok; ++idx)
+      ok = write_action (kb, out, error, order[idx]);
+    g_free (order);
 
-    if (!out_print (out, error, "  </actions>\n"))
+    if (!ok || !out_print (out, error, "  </actions>\n"))
       return false;
   }
 
@@ -380,17 +843,18 @@ keyboard_write_actions (Keyboard *kb, Out *out, GError **error)
 }
 
 static gboolean
-write_terminator (const char *state, const char *output, void *userdata)
+write_terminator (State *state, const char *output, void *userdata)
 {
   struct
   {
     Out *out;
     GError **error;
+    Keyboard *kb;
   } *data = userdata;
 
   if (!out_printf (data->out, data->error,
                    "    <when state=\"%s\" output=\"%s\" />\n",
-                   state, output))
+                   state_id (data->kb, state), output))
     return TRUE;
 
   return FALSE;
@@ -408,7 +872,8 @@ keyboard_write_terminators (Keyboard *kb, Out *out, GError **error)
     {
       Out *out;
       GError **error;
-    } data = { out, error };
+      Keyboard *kb;
+    } data = { out, error, kb };
     g_tree_foreach (kb->terminators, (GTraverseFunc)write_terminator, &data);
 
     if (*error)
@@ -421,165 +886,629 @@ keyboard_write_terminators (Keyboard *kb, Out *out, GError **error)
   return true;
 }
 
-void
-keyboard_set_terminator (Keyboard *kb, const char *state, const char *terminator)
-{
-  g_tree_insert (kb->terminators, (char *)state, (char *)terminator);
-}
-
 bool
-keyboard_parse_keys (Keyboard *kb, char *str, GList **keys, GError **error)
+keyboard_write_id_map (Keyboard *kb, GError **error)
 {
-  /**
-   * Each element can have one or two prefixed modifiers (O-, G-, C-) and
-   * then the representation of a key. There can be multiple keys in
-   * sequence, but the input has already been split on spaces. 
-   */
+  Out *out = out_open (kb->id_map, error);
+  if (out == NULL)
+    return false;
 
-  char *ptr = str;
-  while (*ptr)
+  for (guint idx = 1; idx < kb->states->len; ++idx)
   {
-    int mods = 0;
-    // can be looking at:
-    //   O- or C-
-    //   a bracketed name
-    //   a literal
-    
-    while (ptr[1] == '-'
-        && (*ptr == 'O' || *ptr == 'C'))
+    State *state = g_ptr_array_index (kb->states, idx);
+    if (state->same == NULL
+        && !out_printf (out, error, "%s\t%s\n", state_id (kb, state), state_path (kb, state)))
     {
-      if (*ptr == 'O')
-        mods |= MOD_OPTION;
-      else
-        mods |= MOD_CONTROL;
-
-      ptr += 2;
+      break;
     }
+  }
 
-    if (*ptr == '\0')
-      return make_error (error, "Truncated key list");
+  for (guint idx = 0; idx < kb->action_list->len && *error == NULL; ++idx)
+  {
+    Action *action = g_ptr_array_index (kb->action_list, idx);
+    if (!out_printf (out, error, "%s\t%s\n", action->id, action->name))
+      break;
+  }
 
-    Literal *literal;
-    char *end;
-    if (*ptr == '[' && (end = strchr (ptr, ']')) != NULL)
-    {
-      *end = '\0';
-      ++ptr;
-      char c = lookup_ascii (ptr);
-      if (c == '\0')
-        return make_error (error, "Unknown character name `%s'", ptr);
-
-      char s[2] = { c, '\0' };
-      literal = prefix_map_get (kb->literals, s);
-      if (literal == NULL)
-        return make_error (error, "Unknown character `%s'", ptr);
-      ptr = end + 1;
-    }
-    else
-    {
-      literal = prefix_map_get_prefix (kb->literals, (const char **)&ptr);
-      if (literal == NULL)
-        return make_error (error, "Unknown character `%s'", ptr);
-    }
+  out_close (out, error);
+
+  return *error == NULL;
+}
+
+void
+keyboard_set_terminator (Keyboard *kb, State *state, const char *terminator)
+{
+  g_tree_insert (kb->terminators, state, (char *)terminator);
+}
+
+// states are written in order of their readable names, or their numbers
+void
+keyboard_rank_states (Keyboard *kb)
+{
+  guint n_states = kb->states->len;
+  State **order = g_new (State *, n_states);
+  memcpy (order, kb->states->pdata, n_states * sizeof (State *));
 
-    Key *key = key_new (mods, literal);
-    *keys = g_list_append (*keys, key);
+  if (!kb->numeric_ids && n_states > 1)
+  {
+    // "none" stays first, it's always written before the others
+    for (guint idx = 1; idx < n_states; ++idx)
+      state_path (kb, order[idx]);
+    qsort (order + 1, n_states - 1, sizeof (State *), compare_state_paths);
   }
 
-  return true;
+  for (guint idx = 0; idx < n_states; ++idx)
+    order[idx]->rank = idx;
+
+  g_free (order);
 }
 
-bool
-keyboard_load_sequence (Keyboard *kb, GList *keys, const char *raw_output, GError **error)
+// numeric ids go to the states left after merging, densely and in the order they're written
+void
+keyboard_number_states (Keyboard *kb)
 {
-  static const char *MODS[4] = { NULL, "O-", "C-", "C-O-" };
+  if (!kb->numeric_ids)
+    return;
 
-  char *literal = g_strdup (raw_output);
-  if (!parse_input_to_literal (literal, error))
-    return false;
+  guint n_states = kb->states->len;
+  State **order = g_new (State *, n_states);
+  for (guint idx = 0; idx < n_states; ++idx)
+  {
+    State *state = g_ptr_array_index (kb->states, idx);
+    order[state->rank] = state;
+  }
 
-  char *output = parse_literal_to_output (literal);
-  g_free (literal); // only so much leaking i can take, i guess
+  guint next_id = 0; // from 0, like the action ids; "none" keeps its name
+  for (guint idx = 1; idx < n_states; ++idx)
+  {
+    if (order[idx]->same == NULL)
+      order[idx]->id = arena_printf (kb->arena, "s%u", next_id++);
+  }
+
+  g_free (order);
+}
 
-  char *inc_output = NULL;
-  const char *cur_state = NULL; // leaking all memory
-  const char *prev_state = "none";
-  for (GList *iter = keys; iter != NULL; iter = iter->next)
+static void
+collect_subaction (Subaction *subaction, StateMachine *sm)
+{
+  Transition transition;
+  transition.state = subaction->state->number;
+  transition.action = sm->n_actions;
+  transition.action_type = (guint32)subaction->action_type;
+  if (subaction->action_type == ACTION_OUTPUT)
+    transition.target = str_table_intern (sm->outputs, subaction->output);
+  else
+    transition.target = subaction->next->number;
+
+  g_array_append_val (sm->transitions, transition);
+}
+
+static gboolean
+collect_terminator (State *state, const char *output, StateMachine *sm)
+{
+  guint32 pair[2] = { state->number, str_table_intern (sm->outputs, output) };
+  g_array_append_vals (sm->terminators, pair, 2);
+  return FALSE;
+}
+
+// the subactions get put in the order they're written in, without the
+// states that were merged away
+static void
+keep_subactions (Action *action)
+{
+  guint kept = 0;
+  for (guint idx = 0; idx < action->subactions->len; ++idx)
   {
-    Key *key = iter->data;
-    const char *action_name = key->mods == 0 ? key->literal->name : g_strconcat (MODS[key->mods], key->literal->name, NULL);
-    Action *action = g_tree_lookup (kb->actions, action_name);
-    KeyMapSet *mapset = (key->mods & MOD_CONTROL) != 0 ? kb->control_keymaps : kb->base_keymaps;
+    Subaction *subaction = &g_array_index (action->subactions, Subaction, idx);
+    if (subaction->state->same == NULL)
+    {
+      if (subaction->action_type == ACTION_CHANGE_STATE && subaction->next->same)
+        subaction->next = subaction->next->same;
+      g_array_index (action->subactions, Subaction, kept) = *subaction;
+      ++kept;
+    }
+  }
 
-    if (key->mods == 0)
-      inc_output = inc_output ? g_strconcat (inc_output, key->literal->output, NULL) : key->literal->output;
-    else
-      inc_output = NULL;
-    
-    int new_result_type = -1;
-    const char *new_result_content;
+  g_array_set_size (action->subactions, kept);
+  qsort (action->subactions->data, kept, sizeof (Subaction), compare_subaction_ranks);
+}
+
+static gboolean
+keep_terminator (State *state, const char *output, GTree *terminators)
+{
+  if (state->same == NULL)
+    g_tree_insert (terminators, state, (char *)output);
 
-    if (iter->next == NULL && iter == keys)
+  return FALSE;
+}
+
+// a signature is its length followed by that many words
+static guint
+signature_hash (const guint32 *sig)
+{
+  guint hash = 5381;
+  for (guint32 idx = 0; idx <= sig[0]; ++idx)
+    hash = hash * 33 + sig[idx];
+  return hash;
+}
+
+static gboolean
+signatures_equal (const guint32 *lhs, const guint32 *rhs)
+{
+  return lhs[0] == rhs[0] && memcmp (lhs + 1, rhs + 1, lhs[0] * sizeof (guint32)) == 0;
+}
+
+/**
+ * Merges dead key states that can't be told apart: the same terminator,
+ * and for every action either no <when> for both, the same output, or a
+ * next state that's again equivalent. This is Moore's partition refinement:
+ * states start out split by terminator, and each round splits the blocks
+ * by what their actions do in terms of the blocks of the round before,
+ * until a round splits nothing. Each block keeps the state that's written
+ * first, and the others disappear from the actions and the terminators.
+ * "none" is never merged with anything.
+ */
+void
+keyboard_minimize_states (Keyboard *kb)
+{
+  StateMachine sm = { 0 };
+  sm.outputs = str_table_new ();
+  sm.transitions = g_array_new (FALSE, FALSE, sizeof (Transition));
+  sm.terminators = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  const guint32 none = 0;
+  for (guint idx = 0; idx < kb->action_list->len; ++idx)
+  {
+    Action *action = g_ptr_array_index (kb->action_list, idx);
+    for (guint sub = 0; sub < action->subactions->len; ++sub)
+      collect_subaction (&g_array_index (action->subactions, Subaction, sub), &sm);
+    sm.n_actions += 1;
+  }
+  g_tree_foreach (kb->terminators, (GTraverseFunc)collect_terminator, &sm);
+
+  guint32 n_states = kb->states->len;
+  guint32 n_transitions = sm.transitions->len;
+  const Transition *transitions = (const Transition *)(void *)sm.transitions->data;
+
+  // each state's transitions, in action order
+  guint32 *first = g_new0 (guint32, n_states + 1);
+  guint32 *by_state = g_new (guint32, n_transitions);
+  for (guint32 idx = 0; idx < n_transitions; ++idx)
+    first[transitions[idx].state + 1] += 1;
+  for (guint32 state = 0; state < n_states; ++state)
+    first[state + 1] += first[state];
+  guint32 *fill = g_new (guint32, n_states);
+  memcpy (fill, first, n_states * sizeof (guint32));
+  for (guint32 idx = 0; idx < n_transitions; ++idx)
+    by_state[fill[transitions[idx].state]++] = idx;
+  g_free (fill);
+
+  guint32 *terminator = g_new0 (guint32, n_states);
+  for (guint32 idx = 0; idx < sm.terminators->len; idx += 2)
+    terminator[g_array_index (sm.terminators, guint32, idx)] = g_array_index (sm.terminators, guint32, idx + 1);
+
+  guint32 *block = g_new0 (guint32, n_states);
+  guint32 *new_block = g_new (guint32, n_states);
+  guint32 *sigs = g_new (guint32, 3 * n_states + 3 * n_transitions);
+  guint32 n_blocks = 0;
+  for (bool first_round = true; ; first_round = false)
+  {
+    GHashTable *blocks = g_hash_table_new ((GHashFunc)signature_hash, (GEqualFunc)signatures_equal);
+    guint32 new_n_blocks = 0;
+    guint32 *sig = sigs;
+    for (guint32 state = 0; state < n_states; ++state)
     {
-      if (action == NULL) // it's okay, just change the output
+      guint32 *start = sig++;
+      if (first_round)
       {
-        new_result_type = RESULT_OUTPUT;
-        new_result_content = output;
+        *sig++ = state == none;
+        *sig++ = terminator[state];
       }
       else
       {
-        action_handle_state (action, "none", ACTION_OUTPUT, output, kb);
+        *sig++ = block[state];
+        for (guint32 idx = first[state]; idx < first[state + 1]; ++idx)
+        {
+          const Transition *transition = &transitions[by_state[idx]];
+          *sig++ = transition->action;
+          *sig++ = transition->action_type;
+          *sig++ = transition->action_type == ACTION_OUTPUT ? transition->target : block[transition->target];
+        }
+      }
+      *start = (guint32)(sig - start - 1);
+
+      void *found = g_hash_table_lookup (blocks, start);
+      if (found)
+      {
+        new_block[state] = GPOINTER_TO_UINT (found) - 1;
+      }
+      else
+      {
+        new_block[state] = new_n_blocks;
+        new_n_blocks += 1;
+        g_hash_table_insert (blocks, start, GUINT_TO_POINTER (new_n_blocks));
       }
     }
-    else
+    g_hash_table_destroy (blocks);
+
+    guint32 *swap = block;
+    block = new_block;
+    new_block = swap;
+
+    if (new_n_blocks == n_blocks)
+      break;
+    n_blocks = new_n_blocks;
+  }
+
+  g_free (sigs);
+  g_free (new_block);
+  g_free (terminator);
+  g_free (by_state);
+  g_free (first);
+
+  State **representative = g_new0 (State *, n_blocks);
+  for (guint32 number = 0; number < n_states; ++number)
+  {
+    State *state = g_ptr_array_index (kb->states, number);
+    State **rep = &representative[block[number]];
+    if (*rep == NULL || state->rank < (*rep)->rank)
+      *rep = state;
+  }
+  for (guint32 number = 0; number < n_states; ++number)
+  {
+    State *state = g_ptr_array_index (kb->states, number);
+    if (representative[block[number]] != state)
+      state->same = representative[block[number]];
+  }
+  g_free (representative);
+
+  for (guint idx = 0; idx < kb->action_list->len; ++idx)
+    keep_subactions (g_ptr_array_index (kb->action_list, idx));
+
+  GTree *terminators = g_tree_new ((GCompareFunc)compare_state_ranks);
+  g_tree_foreach (kb->terminators, (GTraverseFunc)keep_terminator, terminators);
+  g_tree_destroy (kb->terminators);
+  kb->terminators = terminators;
+
+  g_free (block);
+  g_array_free (sm.terminators, TRUE);
+  g_array_free (sm.transitions, TRUE);
+  str_table_free (sm.outputs);
+}
+
+guint32
+keyboard_sequence_child (Keyboard *kb, guint32 parent, int mods, Literal *literal)
+{
+  SequenceNode *node = &g_array_index (kb->sequences, SequenceNode, parent);
+  void *key = GUINT_TO_POINTER ((guint)mods * kb->n_literals + literal->index);
+
+  if (node->children == NULL)
+    node->children = g_hash_table_new (NULL, NULL);
+
+  void *found = g_hash_table_lookup (node->children, key);
+  if (found)
+    return GPOINTER_TO_UINT (found);
+
+  // the root is node 0, so it's never anyone's child
+  guint32 child = kb->sequences->len;
+  g_hash_table_insert (node->children, key, GUINT_TO_POINTER (child));
+  if (node->last_child == 0)
+    node->first_child = child;
+  else
+    g_array_index (kb->sequences, SequenceNode, node->last_child).next_sibling = child;
+  node->last_child = child;
+
+  SequenceNode new_node = { mods, literal, NULL, 0, 0, NULL, 0, 0, 0 };
+  g_array_append_val (kb->sequences, new_node); // node isn't valid from here on
+
+  return child;
+}
+
+// adds each line's keys to the trie, and its output to where they end up
+void
+keyboard_merge_mappings (Keyboard *kb, MappingFile *file, guint32 *line)
+{
+  for (guint idx = 0; idx < file->mappings->len; ++idx)
+  {
+    Mapping *mapping = &g_array_index (file->mappings, Mapping, idx);
+    *line += 1;
+
+    guint32 node = 0;
+    for (guint key = mapping->first_key; key < mapping->first_key + mapping->n_keys; ++key)
     {
-      if (action == NULL)
-      {
-        action = action_new (action_name);
-        g_tree_insert (kb->actions, (char *)action_name, action);
+      if (node != 0)
+        g_array_index (kb->sequences, SequenceNode, node).passed_line = *line;
 
-        Point *point = key->literal->points->data;
-        g_assert (point->shift_state != CAPSLOCK);
-        const Result *result = key_map_set_get_result (mapset, key->mods, point->shift_state, point->code);
-        g_assert (result->result_type == RESULT_OUTPUT);
+      MappingKey *mk = &g_array_index (file->keys, MappingKey, key);
+      node = keyboard_sequence_child (kb, node, mk->mods, mk->literal);
+    }
+
+    SequenceNode *seq = &g_array_index (kb->sequences, SequenceNode, node);
+    seq->output = mapping->output; // the last line for a sequence wins
+    seq->output_line = *line;
+  }
+}
+
+void
+keyboard_set_key_results (Keyboard *kb, int mods, Literal *literal, int result_type, const char *content)
+{
+  KeyMapSet *mapset = (mods & MOD_CONTROL) != 0 ? kb->control_keymaps : kb->base_keymaps;
+  for (guint idx = 0; idx < literal->n_points; ++idx)
+  {
+    Point *pt = &literal->points[idx];
 
-        action_handle_state (action, "none", ACTION_OUTPUT, result->content, kb);
+    // ignore capslock when there's a modifier, unless it actually distinguishes literal forms
+    if (mods == 0 || pt->shift_state != CAPSLOCK || kb->active_capslock)
+      key_map_set_set_result (mapset, mods, pt->shift_state, pt->code, result_type, content);
+  }
+}
+
+// makes the key's action the first time it's asked for, when the key still has its own output
+Action *
+keyboard_key_action (Keyboard *kb, int mods, Literal *literal)
+{
+  static const char *MODS[4] = { NULL, "O-", "C-", "C-O-" };
+
+  Action **slot = (Action **)&g_ptr_array_index (kb->action_table, (guint)mods * kb->n_literals + literal->index);
+  if (*slot == NULL)
+  {
+    const char *action_name = mods == 0 ? literal->name : arena_strconcat (kb->arena, MODS[mods], literal->name, NULL);
+    const char *id = kb->numeric_ids ? arena_printf (kb->arena, "a%u", kb->action_list->len) : action_name;
+    Action *action = action_new (action_name, id, kb->arena);
+    *slot = action;
+    g_ptr_array_add (kb->action_list, action);
+
+    KeyMapSet *mapset = (mods & MOD_CONTROL) != 0 ? kb->control_keymaps : kb->base_keymaps;
+    Point *point = &literal->points[0];
+    g_assert (point->shift_state != CAPSLOCK);
+    Result result = key_map_set_get_result (mapset, mods, point->shift_state, point->code);
+    g_assert (RESULT_TYPE (result) == RESULT_OUTPUT);
+
+    // copied, since the string table's blob moves as it grows
+    State *none = g_ptr_array_index (kb->states, 0);
+    action_set_subaction (action, none, arena_strdup (kb->arena, str_table_lookup (kb->strings, RESULT_CONTENT (result))), NULL);
+
+    keyboard_set_key_results (kb, mods, literal, RESULT_ACTION, id);
+  }
+
+  return *slot;
+}
 
-        new_result_type = RESULT_ACTION;
-        new_result_content = action_name;
+/**
+ * The second phase. A single key just gets a new output, unless some
+ * longer sequence uses it; every other key in a sequence gets an action,
+ * whose output in "none" is the key's own. A node with children is a
+ * state. Its terminator is whichever came last, going through the lines
+ * in order: what its keys since the last one with a modifier spell out,
+ * from a line that goes on past it, or the output of a line that ends
+ * there. With neither, a first key's own output is used. The walk is
+ * breadth first, so the states are visited in the order they're numbered,
+ * and each action's subactions come out sorted by state.
+ */
+void
+keyboard_build_sequences (Keyboard *kb)
+{
+  // by state number, the node it comes from, and what its keys since the last modified one spell out (or NULL)
+  GArray *state_nodes = g_array_new (FALSE, FALSE, sizeof (guint32));
+  GPtrArray *spelled = g_ptr_array_new ();
+  guint32 root = 0;
+  g_array_append_val (state_nodes, root);
+  g_ptr_array_add (spelled, "");
+
+  for (guint number = 0; number < kb->states->len; ++number)
+  {
+    State *state = g_ptr_array_index (kb->states, number);
+    const char *prefix = g_ptr_array_index (spelled, number);
+    guint32 child = g_array_index (kb->sequences, SequenceNode, g_array_index (state_nodes, guint32, number)).first_child;
+    for (; child != 0; child = g_array_index (kb->sequences, SequenceNode, child).next_sibling)
+    {
+      SequenceNode *node = &g_array_index (kb->sequences, SequenceNode, child);
+      if (node->first_child == 0 && state->parent == NULL)
+      {
+        // no action can have been made for it yet, they only come from this node or deeper ones
+        keyboard_set_key_results (kb, node->mods, node->literal, RESULT_OUTPUT, node->output);
+        continue;
       }
 
-      if (iter->next == NULL)
+      Action *action = keyboard_key_action (kb, node->mods, node->literal);
+      if (node->first_child == 0)
       {
-        action_handle_state (action, prev_state, ACTION_OUTPUT, output, kb);
+        action_set_subaction (action, state, node->output, NULL);
+        continue;
       }
+
+      // a first key's own output, before "none" changes state instead
+      const char *own = state->parent == NULL ? g_array_index (action->subactions, Subaction, 0).output : NULL;
+      // a modified key starts the spelling over, so "O-a b" spells "b"
+      char *spelled_next = node->mods == 0 ? arena_strconcat (kb->arena, prefix ? prefix : "", node->literal->output, NULL) : NULL;
+
+      State *next = state_new (kb, state, action);
+      action_set_subaction (action, state, NULL, next);
+
+      // a line going through spells it out, a later one ending here overrides that
+      const char *terminator;
+      if (spelled_next && node->passed_line > node->output_line)
+        terminator = spelled_next;
       else
+        terminator = node->output ? node->output : own;
+      if (terminator)
+        keyboard_set_terminator (kb, next, terminator);
+
+      g_array_append_val (state_nodes, child);
+      g_ptr_array_add (spelled, spelled_next);
+    }
+  }
+
+  g_ptr_array_free (spelled, TRUE);
+  g_array_free (state_nodes, TRUE);
+
+  for (guint idx = 0; idx < kb->sequences->len; ++idx)
+  {
+    SequenceNode *node = &g_array_index (kb->sequences, SequenceNode, idx);
+    if (node->children)
+      g_hash_table_destroy (node->children);
+  }
+  g_array_free (kb->sequences, TRUE);
+  kb->sequences = NULL;
+}
+
+BaseEncoding *
+base_encoding_get (const char *name, bool capslock_disables, GError **error)
+{
+  BaseEncoding *base = NULL;
+
+  g_mutex_lock (&base_encodings_lock);
+  if (base_encodings == NULL)
+    base_encodings = g_ptr_array_new ();
+  for (guint idx = 0; idx < base_encodings->len && base == NULL; ++idx)
+  {
+    BaseEncoding *cached = g_ptr_array_index (base_encodings, idx);
+    if (strcmp (cached->name, name) == 0 && cached->capslock_disables == capslock_disables)
+      base = cached;
+  }
+  if (base == NULL)
+  {
+    base = g_slice_alloc0 (sizeof (BaseEncoding));
+    base->name = name;
+    base->capslock_disables = capslock_disables;
+    g_mutex_init (&base->lock);
+    g_ptr_array_add (base_encodings, base);
+  }
+  g_mutex_unlock (&base_encodings_lock);
+
+  // the first keyboard to get here loads it, any others wait for that
+  g_mutex_lock (&base->lock);
+  if (!base->loaded)
+  {
+    // a file of the same name wins over the built-in one
+    gsize n_keys = 0;
+    const BuiltinKey *keys = util_file_exists (name) ? NULL : data_builtin_keys (name, &n_keys);
+    if (keys)
+    {
+      base_encoding_load_builtin (base, keys, n_keys);
+    }
+    else
+    {
+      DataFile *data = data_open (name, &base->error);
+      if (data)
       {
-        cur_state = cur_state ? g_strconcat (cur_state, ".", action_name, NULL) : action_name;
-        action_handle_state (action, prev_state, ACTION_CHANGE_STATE, cur_state, kb);
-        if (inc_output)
-          keyboard_set_terminator (kb, cur_state, inc_output);
-        prev_state = cur_state;
+        base_encoding_load (base, data, &base->error);
+        data_close (data);
       }
     }
+    base->mapping_files = g_ptr_array_new ();
+    base->loaded = true;
+  }
+  g_mutex_unlock (&base->lock);
+
+  // every keyboard gets its own copy of the error
+  if (base->error)
+  {
+    g_propagate_error (error, g_error_copy (base->error));
+    return NULL;
+  }
+
+  return base;
+}
+
+// made the first time it's asked for, but only loaded with mapping_file_load
+MappingFile *
+base_encoding_mapping_file (BaseEncoding *base, const char *data_name, bool osxopt)
+{
+  MappingFile *file = NULL;
+
+  g_mutex_lock (&base->lock);
+  for (guint idx = 0; idx < base->mapping_files->len && file == NULL; ++idx)
+  {
+    MappingFile *cached = g_ptr_array_index (base->mapping_files, idx);
+    if (strcmp (cached->data_name, data_name) == 0 && cached->osxopt == osxopt)
+      file = cached;
+  }
+  if (file == NULL)
+  {
+    file = g_slice_alloc0 (sizeof (MappingFile));
+    file->tokenizer = base->tokenizer;
+    file->data_name = data_name;
+    file->osxopt = osxopt;
+    g_mutex_init (&file->lock);
+    file->mappings = g_array_new (FALSE, FALSE, sizeof (Mapping));
+    file->keys = g_array_new (FALSE, FALSE, sizeof (MappingKey));
+    g_ptr_array_add (base->mapping_files, file);
+  }
+  g_mutex_unlock (&base->lock);
+
+  return file;
+}
+
+void
+base_encoding_start (BaseEncoding *base)
+{
+  base->arena = arena_new ();
+  base->strings = str_table_new ();
+  base->base_keymaps = key_map_set_new (base->arena, base->strings, false, base->capslock_disables);
+  base->control_keymaps = key_map_set_new (base->arena, base->strings, true, base->capslock_disables);
+}
+
+// token is the field with its names replaced; its output, and for a
+// shiftless field its output with control, are worked out unless they're
+// given
+void
+base_encoding_add_field (BaseEncoding *base, GHashTable *literals, GPtrArray *tokens, int code, int shift_state,
+                         const char *token, const char *output, const char *control)
+{
+  Literal *lit = g_hash_table_lookup (literals, token);
+  if (lit == NULL)
+  {
+    char *key = arena_strdup (base->arena, token);
+    lit = literal_new (key, output, tokens->len, base->arena);
+    g_hash_table_insert (literals, key, lit);
+    g_ptr_array_add (tokens, key);
+    if (shift_state == 2)
+      base_encoding_set_capslock_active (base);
+  }
+
+  literal_add_point (lit, shift_state, code, base->arena);
+  key_map_set_set_result (base->base_keymaps, 0, shift_state, code, RESULT_OUTPUT, lit->output);
 
-    if (new_result_type != -1)
+  if (shift_state == 0)
+  {
+    // update control map
+    const char *ctrl = control ? control : lookup_ctrl_code (token);
+    if (ctrl == NULL)
     {
-      for (GList *i = key->literal->points; i != NULL; i = i->next)
-      {
-        Point *pt = i->data;
+      if (strcmp (token, "§") == 0)
+        ctrl = "0"; // weird special case
+      else
+        ctrl = parse_literal_to_output (token, base->arena);
+    }
 
-        // ignore capslock when there's a modifier, unless it actually distinguishes literal forms
-        if (key->mods == 0 || pt->shift_state != CAPSLOCK || kb->active_capslock)
-          key_map_set_set_result (mapset, key->mods, pt->shift_state, pt->code, new_result_type, new_result_content);
-      }
-    }    
+    key_map_set_set_result (base->control_keymaps, 0, 0, code, RESULT_OUTPUT, ctrl);
   }
-  return true;
+}
+
+void
+base_encoding_finish (BaseEncoding *base, GHashTable *literals, GPtrArray *tokens)
+{
+  // from here on the literals are only looked up
+  GPtrArray *lits = g_ptr_array_new ();
+  for (guint idx = 0; idx < tokens->len; ++idx)
+    g_ptr_array_add (lits, g_hash_table_lookup (literals, g_ptr_array_index (tokens, idx)));
+
+  base->n_literals = lits->len;
+  base->literals = prefix_map_build_sorted_utf8 ((const char **)tokens->pdata, lits->pdata, tokens->len);
+  g_hash_table_destroy (literals);
+  g_ptr_array_free (tokens, TRUE);
+  g_ptr_array_free (lits, TRUE);
+  base->tokenizer = tokenizer_new (base->literals);
+
+  key_map_set_make_backup (base->base_keymaps);
+  key_map_set_make_backup (base->control_keymaps);
+  key_map_set_freeze (base->base_keymaps);
+  key_map_set_freeze (base->control_keymaps);
 }
 
 bool
-keyboard_set_base_encoding (Keyboard *kb, const char *data_name, char *data, char *osxalt, GError **error)
+base_encoding_load (BaseEncoding *base, DataFile *data, GError **error)
 {
   // each line in data is: code shiftless shifty capslock
   // they must be separated by space
@@ -588,25 +1517,28 @@ keyboard_set_base_encoding (Keyboard *kb, const char *data_name, char *data, cha
   // if osxalt, apply those changes to the anyOption state
   // make a control map
 
+  const char *data_name = base->name;
+  base_encoding_start (base);
+
+  // collect the literals first, then build the map from all of them at once
+  GHashTable *literals = g_hash_table_new (g_str_hash, g_str_equal);
+  GPtrArray *tokens = g_ptr_array_new ();
+  GString *token = g_string_new (NULL); // each field, once its names are replaced
+
   int lineno = 1;
-  char *ptr = data;
-  while (*ptr)
+  const char *ptr = data->contents;
+  const char *end = ptr + data->len;
+  while (ptr < end)
   {
-    while (isspace (*ptr))
-    {
-      if (*ptr == '\n')
-        ++lineno;
-      ++ptr;
-    }
-
-    if (*ptr == '\0')
+    ptr = scan_spaces (ptr, end, &lineno);
+    if (ptr == end)
       break;
 
     bool done_line = false;
     
-    char *start = ptr;
+    const char *start = ptr;
     int code = 0;
-    while (isdigit (*ptr))
+    while (ptr < end && scan_is_digit (*ptr))
     {
       code *= 10;
       code += (*ptr - '0');
@@ -617,172 +1549,107 @@ keyboard_set_base_encoding (Keyboard *kb, const char *data_name, char *data, cha
       return make_error (error, "Missing numerical code: %s, line %d", data_name, lineno);
     if (code > 127)
       return make_error (error, "Key code too high: %d (max is 127): %s, line %d", code, data_name, lineno);
+    if (ptr == end)
+      return make_error (error, "Unexpected end of file: %s, line %d", data_name, lineno);
     if (*ptr == '\n')
       return make_error (error, "Unexpected end of line: %s, line %d", data_name, lineno);
-    if (!isspace (*ptr))
-      return make_error (error, "Bad delimiter (expected space): %s, line %d", *ptr, data_name, lineno);
+    if (!scan_is_space (*ptr))
+      return make_error (error, "Bad delimiter (expected space): %s, line %d", data_name, lineno);
 
     ++ptr;
     
     for (int shift_state = 0; shift_state < 3; ++shift_state)
     {
-      while (isspace (*ptr) && *ptr != '\n')
-        ++ptr;
-
-      char *token = ptr;
-      while (!isspace (*ptr) && *ptr != '\n' && *ptr != '\0')
-        ++ptr;
+      ptr = scan_blanks (ptr, end);
+      const char *field = ptr;
+      ptr = scan_field_end (ptr, end);
+      gsize field_len = (gsize)(ptr - field);
 
       if (shift_state != 2)
       {
+        if (ptr == end)
+          return make_error (error, "Unexpected end of file: %s, line %d", data_name, lineno);
         if (*ptr == '\n')
           return make_error (error, "Unexpected end of line: %s, line %d", data_name, lineno);
-        if (*ptr == '\0')
-          return make_error (error, "Unexpected end of file: %s, line %d", data_name, lineno);
       }
 
-      if (*ptr != '\0')
+      if (ptr < end)
       {
         if (*ptr == '\n')
         {
           ++lineno;
           done_line = true;
         }
-        *ptr = '\0';
         ++ptr;
       }
 
-      if (shift_state != 2 || kb->capslock_policy != CAPSLOCK_DISABLES)
+      if (shift_state != 2 || !base->capslock_disables)
       {
-        if (!parse_input_to_literal (token, error))
+        if (!parse_input_to_literal (field, field_len, token, error))
           return suffix_error (error, "%s, line %d", data_name, lineno);
         
-        Literal **litp = (Literal **)prefix_map_lookup (kb->literals, token);
-        if (*litp == NULL)
-        {
-          *litp = literal_new (token);
-          if (shift_state == 2)
-            keyboard_set_capslock_active (kb);
-        }
-
-        literal_add_point (*litp, shift_state, code);
-        key_map_set_set_result (kb->base_keymaps, 0, shift_state, code, RESULT_OUTPUT, (*litp)->output);
-
-        if (shift_state == 0)
-        {
-          // update control map
-          const char *ctrl = lookup_ctrl_code (token);
-          if (ctrl == NULL)
-          {
-            if (strcmp (token, "§") == 0)
-              ctrl = "0"; // weird special case
-            else
-              ctrl = parse_literal_to_output (token);
-          }
-
-          key_map_set_set_result (kb->control_keymaps, 0, 0, code, RESULT_OUTPUT, ctrl);
-        }
+        base_encoding_add_field (base, literals, tokens, code, shift_state, token->str, NULL, NULL);
       }
     }
 
     if (!done_line)
-    {
-      while (*ptr != '\n' && *ptr != '\0')
-        ++ptr;
-    }
+      ptr = scan_line_end (ptr, end);
   }
 
-  key_map_set_make_backup (kb->base_keymaps);
-  key_map_set_make_backup (kb->control_keymaps);
+  g_string_free (token, TRUE);
 
-  if (osxalt)
-  {
-    if (!keyboard_load_mappings (kb, "osxalt", osxalt, error))
-      return false;
-  }
+  base_encoding_finish (base, literals, tokens);
   
   return true;
 }
 
-bool
-keyboard_load_mappings (Keyboard *kb, const char *data_name, char *data, GError **error)
+// the same as loading the text it was made from, without reading any of it
+void
+base_encoding_load_builtin (BaseEncoding *base, const BuiltinKey *keys, gsize n_keys)
 {
-  int lineno = 1;
-  
-  char *ptr = data;
-  while (true)
-  {
-    while (isspace (*ptr))
-    {
-      if (*ptr == '\n')
-        ++lineno;
-      ++ptr;
-    }
-    
-    if (*ptr == '\0')
-      break;
-
-    char *output = ptr;
-    while (!isspace (*ptr) && *ptr != '\0')
-      ++ptr;
+  base_encoding_start (base);
 
-    if (ptr == output)
-      return make_error (error, "Missing output (did you mean SPC?): %s, line %d", data_name, lineno);
-    if (*ptr == '\n')
-      return make_error (error, "Unexpected end of line: %s, line %d", data_name, lineno);
-    if (*ptr == '\0')
-      return make_error (error, "Unexpected end of file: %s, line %d", data_name, lineno);
-
-    *ptr = '\0';
-    ++ptr;
+  GHashTable *literals = g_hash_table_new (g_str_hash, g_str_equal);
+  GPtrArray *tokens = g_ptr_array_new ();
 
-    while (isspace (*ptr))
+  for (gsize idx = 0; idx < n_keys; ++idx)
+  {
+    const BuiltinKey *key = &keys[idx];
+    for (int shift_state = 0; shift_state < 3; ++shift_state)
     {
-      if (*ptr == '\n')
-        return make_error (error, "Unexpected end of line: %s, line %d", data_name, lineno);
-      ++ptr;
+      if (shift_state != 2 || !base->capslock_disables)
+        base_encoding_add_field (base, literals, tokens, key->code, shift_state,
+                                 key->literals[shift_state], key->outputs[shift_state], key->control);
     }
+  }
 
-    if (*ptr == '\0')
-      return make_error (error, "Unexpected end of file: %s, line %d", data_name, lineno);
-
-    // now at the start of the key sequence to produce the output
-    // and we know there's SOMETHING at least
-    GList *keys = NULL;
-    bool done_line = false;
-    while (!done_line)
-    {
-      char *start = ptr;
-      while (!isspace (*ptr) && *ptr != '\0')
-        ++ptr;
-
-      if (*ptr != '\0')
-      {
-        char *end = ptr;
-        while (isspace (*ptr))
-        {
-          if (*ptr == '\n')
-          {
-            done_line = true;
-            ++lineno;
-            ++ptr;
-            break;
-          }
-          ++ptr;
-        }
-        *end = '\0';
-
-      }
+  base_encoding_finish (base, literals, tokens);
+}
 
-      if (!keyboard_parse_keys (kb, start, &keys, error))
-        return suffix_error (error, "%s, line %d", data_name, lineno);
-    }
+void
+base_encoding_set_capslock_active (BaseEncoding *base)
+{
+  g_assert (!base->capslock_disables);
+  base->active_capslock = true;
+  key_map_set_set_capslock_active (base->base_keymaps);
+  key_map_set_set_capslock_active (base->control_keymaps);
+}
 
-    if (!keyboard_load_sequence (kb, keys, output, error))
-      return false;
-  }
-  
-  return true;
+// the keyboard's keymaps start out as clones of the base encoding's, and
+// everything else it needs from it is shared
+void
+keyboard_set_base_encoding (Keyboard *kb, BaseEncoding *base)
+{
+  kb->strings = str_table_copy (base->strings);
+  kb->base_keymaps = key_map_set_clone (base->base_keymaps, kb->arena, kb->strings);
+  kb->control_keymaps = key_map_set_clone (base->control_keymaps, kb->arena, kb->strings);
+  kb->literals = base->literals;
+  kb->tokenizer = base->tokenizer;
+  kb->n_literals = base->n_literals;
+  kb->active_capslock = base->active_capslock;
+
+  // a slot for each modifier combination of each literal
+  g_ptr_array_set_size (kb->action_table, (gint)(4 * kb->n_literals));
 }
 
 /**
@@ -793,10 +1660,13 @@ Keyboard *keyboard_new (const char *name,
                         const char *url,
                         const char *language,
                         const char *icons_source,
-                        GList *datafiles,
+                        GPtrArray *datafiles,
                         const char *base_encoding,
                         bool osxopt,
-                        int capslock_policy)
+                        int capslock_policy,
+                        bool delta_keymaps,
+                        bool numeric_ids,
+                        const char *id_map)
 {
   Keyboard *kb = g_slice_alloc0 (sizeof (Keyboard));
 
@@ -810,13 +1680,23 @@ Keyboard *keyboard_new (const char *name,
   kb->base_encoding = base_encoding;
   kb->osxopt = osxopt;
   kb->capslock_policy = capslock_policy;
-
-  kb->base_keymaps = key_map_set_new (false, kb->capslock_policy == CAPSLOCK_DISABLES);
-  kb->control_keymaps = key_map_set_new (true, kb->capslock_policy == CAPSLOCK_DISABLES);
-
-  kb->literals = prefix_map_new ();
-  kb->actions = g_tree_new ((GCompareFunc)strcmp);
-  kb->terminators = g_tree_new ((GCompareFunc)strcmp);
+  kb->delta_keymaps = delta_keymaps;
+  kb->numeric_ids = numeric_ids;
+  kb->id_map = id_map;
+
+  kb->arena = arena_new ();
+  kb->strings = NULL; // these all come from the base encoding
+  kb->base_keymaps = NULL;
+  kb->control_keymaps = NULL;
+  kb->literals = NULL;
+
+  kb->action_table = g_ptr_array_new ();
+  kb->action_list = g_ptr_array_new ();
+  kb->states = g_ptr_array_new ();
+  state_new (kb, NULL, NULL); // "none"
+  kb->sequences = g_array_new (FALSE, TRUE, sizeof (SequenceNode));
+  g_array_set_size (kb->sequences, 1); // the root, for the empty sequence
+  kb->terminators = g_tree_new ((GCompareFunc)compare_state_numbers);
 
   return kb;
 }
@@ -824,45 +1704,61 @@ Keyboard *keyboard_new (const char *name,
 bool
 keyboard_load_data (Keyboard *kb, GError **error)
 {
-  char *data = data_load (kb->base_encoding, error);
-  if (data == NULL)
+  BaseEncoding *base = base_encoding_get (kb->base_encoding, kb->capslock_policy == CAPSLOCK_DISABLES, error);
+  if (base == NULL)
     return false;
 
-  char *osxopt;
-  if (kb->osxopt)
-  {
-    osxopt = data_load_internal (KB_DATA_OSXOPT, error);
-    if (osxopt == NULL)
-      return false;
-  }
-  else
-  {
-    osxopt = NULL;
-  }
+  keyboard_set_base_encoding (kb, base);
 
-  if (!keyboard_set_base_encoding (kb, kb->base_encoding, data, osxopt, error))
-    return false;
+  // loaded all at once, then merged in order, so osxopt comes first, later
+  // datafiles still override earlier ones, and the first error reported is
+  // the first file's
+  guint n_files = 0;
+  MappingFile **files = g_new (MappingFile *, kb->datafiles->len + 1);
+  if (kb->osxopt)
+    files[n_files++] = base_encoding_mapping_file (base, "osxalt", true);
+  for (guint idx = 0; idx < kb->datafiles->len; ++idx)
+    files[n_files++] = base_encoding_mapping_file (base, g_ptr_array_index (kb->datafiles, idx), false);
 
-  // not freeing data, &c because it's chopped up into little strings that can still be used
+  mapping_files_load (files, n_files);
 
-  for (GList *iter = kb->datafiles; iter != NULL; iter = iter->next)
+  bool ok = true;
+  guint32 line = 0;
+  for (guint idx = 0; idx < n_files && ok; ++idx)
   {
-    const char *data_name = iter->data;
-    data = data_load (data_name, error);
-    if (data == NULL || !keyboard_load_mappings (kb, data_name, data, error))
-      return false;
+    if (files[idx]->error)
+    {
+      g_propagate_error (error, g_error_copy (files[idx]->error));
+      ok = false;
+    }
+    else
+    {
+      keyboard_merge_mappings (kb, files[idx], &line);
+    }
   }
+  g_free (files);
 
-  return true;
+  if (ok)
+    keyboard_build_sequences (kb);
+
+  return ok;
 }
 
 bool
 keyboard_write_keylayout (Keyboard *kb, GError **error)
 {
   int index = 0;
+  GHashTable *maps = key_map_table_new (); // identical maps are only written once
   key_map_set_maybe_unshift (kb->control_keymaps);
-  key_map_set_assign_mods (kb->base_keymaps, &index);
-  key_map_set_assign_mods (kb->control_keymaps, &index);
+  key_map_set_assign_mods (kb->base_keymaps, &index, maps);
+  key_map_set_assign_mods (kb->control_keymaps, &index, maps);
+  if (kb->delta_keymaps)
+    key_map_table_choose_bases (maps);
+  g_hash_table_destroy (maps);
+
+  keyboard_rank_states (kb);
+  keyboard_minimize_states (kb);
+  keyboard_number_states (kb);
 
   Out *out = out_open (kb->keylayout_basename, error);
   if (out == NULL)
@@ -878,7 +1774,7 @@ keyboard_write_keylayout (Keyboard *kb, GError **error)
 
       || !out_print (out, error,
                      "  <layouts>\n"
-                     "    <layout first=\"0\" last=\"0\" mapSet=\"maps\" modifiers=\"mods\" />\n"
+                     "    <layout first=\"0\" last=\"0\" mapSet=\"" KEY_MAP_SET_ID "\" modifiers=\"mods\" />\n"
                      "  </layouts>\n")
 
       || !out_print (out, error,
@@ -889,7 +1785,7 @@ keyboard_write_keylayout (Keyboard *kb, GError **error)
 
       || !out_print (out, error,
                      "  </modifierMap>\n"
-                     "  <keyMapSet id=\"maps\">\n")
+                     "  <keyMapSet id=\"" KEY_MAP_SET_ID "\">\n")
 
       || !key_map_set_write_maps (kb->base_keymaps, out, error)
       || !key_map_set_write_maps (kb->control_keymaps, out, error)
@@ -907,9 +1803,42 @@ keyboard_write_keylayout (Keyboard *kb, GError **error)
 
   out_close (out, error);
 
+  if (*error == NULL && kb->id_map)
+    return keyboard_write_id_map (kb, error);
+
   return *error == NULL;
 }
 
+void
+keyboard_release (Keyboard *kb)
+{
+  for (guint idx = 0; idx < kb->action_list->len; ++idx)
+  {
+    Action *action = g_ptr_array_index (kb->action_list, idx);
+    g_array_free (action->subactions, TRUE);
+  }
+  g_ptr_array_free (kb->action_list, TRUE);
+  g_ptr_array_free (kb->action_table, TRUE);
+  g_ptr_array_free (kb->states, TRUE);
+  g_tree_destroy (kb->terminators);
+
+  // the literals and tokenizer are the base encoding's
+  if (kb->strings)
+    str_table_free (kb->strings);
+  arena_free (kb->arena);
+
+  kb->action_list = NULL;
+  kb->action_table = NULL;
+  kb->states = NULL;
+  kb->terminators = NULL;
+  kb->literals = NULL;
+  kb->tokenizer = NULL;
+  kb->strings = NULL;
+  kb->base_keymaps = NULL;
+  kb->control_keymaps = NULL;
+  kb->arena = NULL;
+}
+
 bool
 keyboard_write_info_plist (Keyboard *kb, Out *out, GError **error)
 {
@@ -2,8 +2,10 @@
 #define OSX_KB_KEYBOARD
 
 #include "common.h"
+#include "arena.h"
 #include "keymap.h"
 #include "prefixmap.h"
+#include "tokenizer.h"
 
 typedef struct _Keyboard Keyboard;
 
@@ -23,17 +25,27 @@ struct _Keyboard
   const char *url;
   const char *language;
   const char *icons_source;
-  GList *datafiles;
+  GPtrArray *datafiles; // of names, in the order they're loaded
   const char *base_encoding;
   bool osxopt;
   int capslock_policy;
+  bool delta_keymaps;
+  bool numeric_ids;
+  const char *id_map; // where to write what the numeric ids stand for, or NULL
 
-  KeyMapSet *base_keymaps;
+  Arena *arena; // owns everything made while building, until keyboard_release
+  StrTable *strings; // every result content in the keymaps, interned
+  KeyMapSet *base_keymaps; // cloned from the base encoding's
   KeyMapSet *control_keymaps;
 
-  PrefixMap *literals;
-  GTree *actions;
+  PrefixMap *literals; // shared with every keyboard on the same base encoding
+  Tokenizer *tokenizer; // likewise
+  guint n_literals;
+  GPtrArray *action_table; // by mods * n_literals + literal index, or NULL
+  GPtrArray *action_list; // the same actions, in the order they were made
+  GPtrArray *states; // by number, starting with "none"
   GTree *terminators;
+  GArray *sequences; // the trie of every mapping line's keys, until the actions are made from it
 
   bool active_capslock; // this means that for some key in the base encoding, the result when holding capslock is distinct from both shifty and shiftless
 };
@@ -42,14 +54,18 @@ Keyboard *keyboard_new (const char *name,
                         const char *url,
                         const char *language,
                         const char *icons_source,
-                        GList *datafiles,
+                        GPtrArray *datafiles,
                         const char *base_encoding,
                         bool osxopt,
-                        int capslock_policy);
+                        int capslock_policy,
+                        bool delta_keymaps,
+                        bool numeric_ids,
+                        const char *id_map);
 
 bool keyboard_load_data (Keyboard *kb, GError **error);
 
 bool keyboard_write_keylayout (Keyboard *kb, GError **error);
+void keyboard_release (Keyboard *kb); // frees what was built, once the keylayout's written
 bool keyboard_write_info_plist (Keyboard *kb, Out *out, GError **error);
 
 #endif
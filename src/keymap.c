@@ -1,67 +1,81 @@
 #include "keymap.h"
 #include <string.h>
 
-static Result *key_map_set_lookup_result (KeyMapSet *set, int mods, int shift_state, int code);
+static KeyMap *key_map_set_lookup_map (KeyMapSet *set, int mods, int shift_state);
 
-static KeyMapSubset *key_map_subset_new (bool is_control, bool is_option, bool capslock_disables);
+static KeyMapSubset *key_map_subset_new (Arena *arena, bool is_control, bool is_option, bool capslock_disables);
 static KeyMapSubset *key_map_subset_copy (KeyMapSubset *src);
+static void key_map_subset_freeze (KeyMapSubset *set);
+static KeyMapSubset *key_map_subset_clone (const KeyMapSubset *src, Arena *arena);
 static void key_map_subset_set_backup (KeyMapSubset *set, KeyMap *backup);
 static void key_map_subset_distinguish_shift_state (KeyMapSubset *set);
-static Result *key_map_subset_lookup_result (KeyMapSubset *set, int shift_state, int code);
+static KeyMap *key_map_subset_lookup_map (KeyMapSubset *set, int shift_state);
 static void key_map_subset_maybe_unshift (KeyMapSubset *set);
-static void key_map_subset_assign_mods (KeyMapSubset *set, const char *required, const char *permitted, int *index);
+static void key_map_subset_assign_mods (KeyMapSubset *set, int required, int permitted, int *index, GHashTable *maps);
 
 static bool key_map_subset_write_mods (KeyMapSubset *set, Out *out, GError **error);
-static bool key_map_subset_write_maps (KeyMapSubset *set, Out *out, GError **error);
+static bool key_map_subset_write_maps (KeyMapSubset *set, const StrTable *strings, Out *out, GError **error);
 
 static void key_map_subset_set_capslock_active (KeyMapSubset *set);
 
-static KeyMap *key_map_new (void);
-static KeyMap *key_map_copy (KeyMap *src);
-static Result *key_map_lookup_result (KeyMap *map, int code);
-static void key_map_assign_mods (KeyMap *map, const char *requied, const char *also_required, const char *permitted, const char *also_permitted);
-static void key_map_assign_index (KeyMap *map, int *index);
+static KeyMap *key_map_new (Arena *arena);
+static void key_map_freeze (KeyMap *map, Arena *arena);
+static KeyMap *key_map_copy (KeyMap *src, Arena *arena);
+static Result key_map_get_result (const KeyMap *map, int code);
+static void key_map_set_result (KeyMap *map, int code, Result result, Arena *arena);
+static void key_map_flatten (const KeyMap *map, Result *flat, guint64 *present);
+static void key_map_assign_mods (KeyMap *map, int required, int permitted);
+static void key_map_assign_index (KeyMap *map, int *index, GHashTable *maps);
 
 static bool key_map_write_mods (KeyMap *map, Out *out, GError **error);
-static bool key_map_write (KeyMap *map, Out *out, GError **error);
+static bool key_map_write (KeyMap *map, const StrTable *strings, Out *out, GError **error);
+
+static int key_map_count_changes (KeyMap *map, KeyMap *base);
+static int key_maps_compare_index (const void *lhs, const void *rhs);
+
+static int count_bits (guint64 bits);
+static int lowest_bit (guint64 bits);
 
 static bool key_maps_eq (KeyMap *lhs, KeyMap *rhs);
+static guint key_map_hash (const KeyMap *map);
+static gboolean key_maps_identical (const KeyMap *lhs, const KeyMap *rhs);
 
 /**
  * Private procedures
  */
 
-Result *
-key_map_set_lookup_result (KeyMapSet *set, int mods, int shift_state, int code)
+KeyMap *
+key_map_set_lookup_map (KeyMapSet *set, int mods, int shift_state)
 {
   if ((mods & MOD_OPTION) != 0)
   {
     if (set->opt_maps == NULL)
       set->opt_maps = key_map_subset_copy (set->backup_maps);
 
-    return key_map_subset_lookup_result (set->opt_maps, shift_state, code);
+    return key_map_subset_lookup_map (set->opt_maps, shift_state);
   }
   else
   {
-    return key_map_subset_lookup_result (set->plain_maps, shift_state, code);
+    return key_map_subset_lookup_map (set->plain_maps, shift_state);
   }
 }
 
 KeyMapSubset *
-key_map_subset_new (bool is_control, bool is_option, bool capslock_disables)
+key_map_subset_new (Arena *arena, bool is_control, bool is_option, bool capslock_disables)
 {
-  KeyMapSubset *set = g_slice_alloc0 (sizeof (KeyMapSubset));
+  KeyMapSubset *set = arena_alloc0 (arena, sizeof (KeyMapSubset));
 
+  set->arena = arena;
   set->is_control = is_control;
   set->is_option = is_option;
   set->capslock_disables = capslock_disables;
 
-  set->shiftless_map = key_map_new ();
+  set->shiftless_map = key_map_new (set->arena);
   if (!set->is_control)
   {
-    set->shifty_map = key_map_new ();
+    set->shifty_map = key_map_new (set->arena);
     if (!set->is_option && !capslock_disables)
-      set->capslock_map = key_map_new ();
+      set->capslock_map = key_map_new (set->arena);
   }
 
   return set;
@@ -70,25 +84,53 @@ key_map_subset_new (bool is_control, bool is_option, bool capslock_disables)
 KeyMapSubset *
 key_map_subset_copy (KeyMapSubset *src)
 {
-  KeyMapSubset *set = g_slice_alloc0 (sizeof (KeyMapSubset));
+  KeyMapSubset *set = arena_alloc0 (src->arena, sizeof (KeyMapSubset));
 
+  set->arena = src->arena;
   set->is_control = src->is_control;
   set->is_option = src->is_option;
   set->capslock_disables = src->capslock_disables;
   set->active_capslock = src->active_capslock;
 
-  set->shiftless_map = key_map_copy (src->shiftless_map);
+  set->shiftless_map = key_map_copy (src->shiftless_map, set->arena);
 
   if (!set->is_control)
   {
-    set->shifty_map = key_map_copy (src->shifty_map);
+    set->shifty_map = key_map_copy (src->shifty_map, set->arena);
     if (!set->is_option && !set->capslock_disables && set->active_capslock)
-      set->capslock_map = key_map_copy (src->capslock_map);
+      set->capslock_map = key_map_copy (src->capslock_map, set->arena);
   }
   
   return set;
 }
 
+void
+key_map_subset_freeze (KeyMapSubset *set)
+{
+  KeyMap *maps[4] = { set->shiftless_map, set->shifty_map, set->capslock_map, set->backup_map };
+  for (int idx = 0; idx < 4; ++idx)
+  {
+    if (maps[idx])
+      key_map_freeze (maps[idx], set->arena);
+  }
+}
+
+// the backup map belongs to another subset, so the set points it at that one's clone
+KeyMapSubset *
+key_map_subset_clone (const KeyMapSubset *src, Arena *arena)
+{
+  KeyMapSubset *set = arena_alloc (arena, sizeof (KeyMapSubset));
+  *set = *src;
+
+  set->arena = arena;
+  set->shiftless_map = key_map_copy (src->shiftless_map, arena);
+  set->shifty_map = src->shifty_map ? key_map_copy (src->shifty_map, arena) : NULL;
+  set->capslock_map = src->capslock_map ? key_map_copy (src->capslock_map, arena) : NULL;
+  set->backup_map = NULL;
+
+  return set;
+}
+
 void
 key_map_subset_set_backup (KeyMapSubset *set, KeyMap *backup)
 {
@@ -102,24 +144,24 @@ key_map_subset_distinguish_shift_state (KeyMapSubset *set)
   g_assert (set->backup_map != NULL);
   // and we know this is in the control maps
 
-  set->shifty_map = key_map_copy (set->backup_map);
+  set->shifty_map = key_map_copy (set->backup_map, set->arena);
   if (set->active_capslock)
-    set->capslock_map = key_map_copy (set->backup_map);
+    set->capslock_map = key_map_copy (set->backup_map, set->arena);
 }
 
-Result *
-key_map_subset_lookup_result (KeyMapSubset *set, int shift_state, int code)
+KeyMap *
+key_map_subset_lookup_map (KeyMapSubset *set, int shift_state)
 {
   if (shift_state == SHIFTLESS)
   {
-    return key_map_lookup_result (set->shiftless_map, code);
+    return set->shiftless_map;
   }
   else if (shift_state == SHIFTY)
   {
     if (set->shifty_map == NULL)
       key_map_subset_distinguish_shift_state (set);
 
-    return key_map_lookup_result (set->shifty_map, code);
+    return set->shifty_map;
   }
   else
   {
@@ -131,7 +173,7 @@ key_map_subset_lookup_result (KeyMapSubset *set, int shift_state, int code)
       key_map_subset_distinguish_shift_state (set);
     }
 
-    return key_map_lookup_result (set->capslock_map, code);
+    return set->capslock_map;
   }
 }
 
@@ -143,57 +185,57 @@ key_map_subset_maybe_unshift (KeyMapSubset *set)
     if (key_maps_eq (set->shiftless_map, set->shifty_map)
         && (set->capslock_map == NULL || key_maps_eq (set->shiftless_map, set->capslock_map)))
     {
-      set->shifty_map = NULL; // leak!
+      set->shifty_map = NULL; // left to the arena
       set->capslock_map = NULL;
     }
   }
 }
 
 void
-key_map_subset_assign_mods (KeyMapSubset *set, const char *required, const char *permitted, int *index)
+key_map_subset_assign_mods (KeyMapSubset *set, int required, int permitted, int *index, GHashTable *maps)
 {
   if (set->capslock_disables)
   {
     g_assert (set->capslock_map == NULL);
     if (set->shifty_map)
     {
-      key_map_assign_mods (set->shiftless_map, required, "", permitted, "");
-      key_map_assign_mods (set->shiftless_map, required, " command", permitted, " anyShift?");
-      key_map_assign_mods (set->shifty_map, required, " anyShift", permitted, "");
+      key_map_assign_mods (set->shiftless_map, required, permitted);
+      key_map_assign_mods (set->shiftless_map, required | MODIFIER_COMMAND, permitted | MODIFIER_SHIFT);
+      key_map_assign_mods (set->shifty_map, required | MODIFIER_SHIFT, permitted);
     }
     else
     {
-      key_map_assign_mods (set->shiftless_map, required, "", permitted, " command? anyShift?");
+      key_map_assign_mods (set->shiftless_map, required, permitted | MODIFIER_COMMAND | MODIFIER_SHIFT);
     }
   }
   else if (set->shifty_map)
   {
     if (set->capslock_map)
     {
-      key_map_assign_mods (set->shiftless_map, required, "", permitted, "");
-      key_map_assign_mods (set->shifty_map, required, " anyShift", permitted, " caps?");
-      key_map_assign_mods (set->capslock_map, required, " caps", permitted, "");
+      key_map_assign_mods (set->shiftless_map, required, permitted);
+      key_map_assign_mods (set->shifty_map, required | MODIFIER_SHIFT, permitted | MODIFIER_CAPS);
+      key_map_assign_mods (set->capslock_map, required | MODIFIER_CAPS, permitted);
     }
     else
     {
-      key_map_assign_mods (set->shiftless_map, required, "", permitted, " caps?");
-      key_map_assign_mods (set->shifty_map, required, " anyShift", permitted, " caps?");
+      key_map_assign_mods (set->shiftless_map, required, permitted | MODIFIER_CAPS);
+      key_map_assign_mods (set->shifty_map, required | MODIFIER_SHIFT, permitted | MODIFIER_CAPS);
     }
 
-    key_map_assign_mods (set->shiftless_map, required, " command", permitted, " anyShift? caps?");
+    key_map_assign_mods (set->shiftless_map, required | MODIFIER_COMMAND, permitted | MODIFIER_SHIFT | MODIFIER_CAPS);
   }
   else
   {
     // no shifty map, but capslock doesn't disable
-    key_map_assign_mods (set->shiftless_map, required, "", permitted, " command? anyShift? caps?");    
+    key_map_assign_mods (set->shiftless_map, required, permitted | MODIFIER_COMMAND | MODIFIER_SHIFT | MODIFIER_CAPS);
   }
 
-  key_map_assign_index (set->shiftless_map, index);
+  key_map_assign_index (set->shiftless_map, index, maps);
   if (set->shifty_map)
   {
-    key_map_assign_index (set->shifty_map, index);
+    key_map_assign_index (set->shifty_map, index, maps);
     if (set->capslock_map)
-      key_map_assign_index (set->capslock_map, index);
+      key_map_assign_index (set->capslock_map, index, maps);
   }
 }
 
@@ -211,11 +253,11 @@ key_map_subset_write_mods (KeyMapSubset *set, Out *out, GError **error)
 }
 
 bool
-key_map_subset_write_maps (KeyMapSubset *set, Out *out, GError **error)
+key_map_subset_write_maps (KeyMapSubset *set, const StrTable *strings, Out *out, GError **error)
 {
-  if (!key_map_write (set->shiftless_map, out, error)
-      || (set->shifty_map && !key_map_write (set->shifty_map, out, error))
-      || (set->capslock_map && !key_map_write (set->capslock_map, out, error)))
+  if (!key_map_write (set->shiftless_map, strings, out, error)
+      || (set->shifty_map && !key_map_write (set->shifty_map, strings, out, error))
+      || (set->capslock_map && !key_map_write (set->capslock_map, strings, out, error)))
   {
     return false;
   }
@@ -231,49 +273,158 @@ key_map_subset_set_capslock_active (KeyMapSubset *set)
 }
 
 KeyMap *
-key_map_new ()
+key_map_new (Arena *arena)
 {
-  KeyMap *map = g_slice_alloc0 (sizeof (KeyMap));
+  KeyMap *map = arena_alloc0 (arena, sizeof (KeyMap));
 
   return map;
 }
 
+// map's own entries become a layer that it, and anything copied from it,
+// will never write to; the layer comes from arena
+void
+key_map_freeze (KeyMap *map, Arena *arena)
+{
+  if (map->n_entries > 0)
+  {
+    KeyMap *layer = arena_alloc0 (arena, sizeof (KeyMap));
+    layer->parent = map->parent;
+    layer->present[0] = map->present[0];
+    layer->present[1] = map->present[1];
+    layer->entries = map->entries;
+    layer->n_entries = map->n_entries;
+
+    map->parent = layer;
+    map->present[0] = map->present[1] = 0;
+    map->entries = NULL;
+    map->n_entries = 0;
+  }
+}
+
+// src is only written to if it has entries of its own, which are then
+// frozen into arena
 KeyMap *
-key_map_copy (KeyMap *src)
+key_map_copy (KeyMap *src, Arena *arena)
 {
-  g_assert (src->mods == NULL && src->index == 0);
+  g_assert (src->mods == 0 && src->index == 0);
 
-  KeyMap *map = g_slice_alloc0 (sizeof (KeyMap));
+  key_map_freeze (src, arena);
 
-  memcpy (map->keys, src->keys, 128 * sizeof (Result));
+  KeyMap *map = arena_alloc0 (arena, sizeof (KeyMap));
+  map->parent = src->parent;
 
   return map;
 }
 
-Result *
-key_map_lookup_result (KeyMap *map, int code)
+Result
+key_map_get_result (const KeyMap *map, int code)
 {
   g_assert (code >= 0 && code < 128);
-  return &map->keys[code];
+
+  int word = code / 64;
+  guint64 bit = (guint64)1 << (code % 64);
+  for (const KeyMap *layer = map; layer != NULL; layer = layer->parent)
+  {
+    if ((layer->present[word] & bit) != 0)
+    {
+      int rank = count_bits (layer->present[word] & (bit - 1));
+      if (word == 1)
+        rank += count_bits (layer->present[0]);
+      return layer->entries[rank];
+    }
+  }
+
+  return 0;
 }
 
 void
-key_map_assign_mods (KeyMap *map, const char *required, const char *also_required, const char *permitted, const char *also_permitted)
+key_map_set_result (KeyMap *map, int code, Result result, Arena *arena)
 {
-  char *mods = g_strconcat (required, also_required, permitted, also_permitted, NULL); // will likely start with a space
-  map->mods = g_list_append (map->mods, mods);
+  g_assert (code >= 0 && code < 128);
+
+  int word = code / 64;
+  guint64 bit = (guint64)1 << (code % 64);
+  int rank = count_bits (map->present[word] & (bit - 1));
+  if (word == 1)
+    rank += count_bits (map->present[0]);
+
+  if ((map->present[word] & bit) == 0)
+  {
+    // entries are kept in code order, and only ever grow a few at a time;
+    // an outgrown array stays in the arena
+    if ((map->n_entries & (map->n_entries - 1)) == 0)
+    {
+      Result *entries = arena_alloc (arena, (gsize)(map->n_entries == 0 ? 1 : map->n_entries * 2) * sizeof (Result));
+      if (map->n_entries > 0)
+        memcpy (entries, map->entries, (size_t)map->n_entries * sizeof (Result));
+      map->entries = entries;
+    }
+
+    memmove (map->entries + rank + 1, map->entries + rank, (size_t)(map->n_entries - rank) * sizeof (Result));
+    map->n_entries += 1;
+    map->present[word] |= bit;
+  }
+
+  map->entries[rank] = result;
+}
+
+// flat[code] is the result for each of the 128 codes, and present gets a
+// bit set for each code that has one
+void
+key_map_flatten (const KeyMap *map, Result *flat, guint64 *present)
+{
+  memset (flat, 0, 128 * sizeof (Result));
+
+  // the first layer to have a key is the one that counts
+  present[0] = present[1] = 0;
+  for (const KeyMap *layer = map; layer != NULL; layer = layer->parent)
+  {
+    const Result *entry = layer->entries;
+    for (int word = 0; word < 2; ++word)
+    {
+      for (guint64 bits = layer->present[word]; bits != 0; bits &= bits - 1, ++entry)
+      {
+        int bit = lowest_bit (bits);
+        if ((present[word] & ((guint64)1 << bit)) == 0)
+          flat[word * 64 + bit] = *entry;
+      }
+      present[word] |= layer->present[word];
+    }
+  }
 }
 
 void
-key_map_assign_index (KeyMap *map, int *index)
+key_map_assign_mods (KeyMap *map, int required, int permitted)
 {
-  map->index = *index;
-  *index += 1;
+  map->mods |= modifier_states (required, permitted);
+}
+
+void
+key_map_assign_index (KeyMap *map, int *index, GHashTable *maps)
+{
+  KeyMap *same = g_hash_table_lookup (maps, map);
+  if (same)
+  {
+    // written once, selected by the modifiers of both
+    map->shared = same;
+    map->index = same->index;
+    same->mods |= map->mods;
+    map->mods = 0;
+  }
+  else
+  {
+    g_hash_table_insert (maps, map, map);
+    map->index = *index;
+    *index += 1;
+  }
 }
 
 bool
 key_map_write_mods (KeyMap *map, Out *out, GError **error)
 {
+  if (map->shared)
+    return true;
+
   if (!out_printf (out, error,
                    "    <keyMapSelect mapIndex=\"%d\">\n",
                    map->index))
@@ -281,19 +432,8 @@ key_map_write_mods (KeyMap *map, Out *out, GError **error)
     return false;
   }
 
-  for (GList *iter = map->mods; iter != NULL; iter = iter->next)
-  {
-    const char *mods = iter->data;
-    if (*mods == ' ')
-      ++mods;
-    
-    if (!out_printf (out, error,
-                     "      <modifier keys=\"%s\" />\n",
-                     mods))
-    {
-      return false;
-    }
-  }
+  if (!modifier_states_write (map->mods, out, error))
+    return false;
 
   if (!out_print (out, error,
                   "    </keyMapSelect>\n"))
@@ -306,31 +446,48 @@ key_map_write_mods (KeyMap *map, Out *out, GError **error)
 
 
 bool
-key_map_write (KeyMap *map, Out *out, GError **error)
+key_map_write (KeyMap *map, const StrTable *strings, Out *out, GError **error)
 {
-  if (!out_printf (out, error,
-                   "    <keyMap index=\"%d\">\n",
-                   map->index))
+  if (map->shared)
+    return true;
+
+  if (map->base)
+  {
+    if (!out_printf (out, error,
+                     "    <keyMap index=\"%d\" baseMapSet=\"" KEY_MAP_SET_ID "\" baseIndex=\"%d\">\n",
+                     map->index, map->base->index))
+    {
+      return false;
+    }
+  }
+  else if (!out_printf (out, error,
+                        "    <keyMap index=\"%d\">\n",
+                        map->index))
   {
     return false;
   }
 
-  for (int idx = 0; idx < 128; ++idx)
+  Result flat[128];
+  Result inherited[128];
+  guint64 present[2];
+  guint64 base_present[2];
+  key_map_flatten (map, flat, present);
+  if (map->base)
+    key_map_flatten (map->base, inherited, base_present);
+
+  // only the keys that are set, in code order
+  for (int word = 0; word < 2; ++word)
   {
-    if (map->keys[idx].result_type == RESULT_OUTPUT)
-    {
-      if (!out_printf (out, error,
-                       "      <key code=\"%d\" output=\"%s\" />\n",
-                       idx, map->keys[idx].content))
-      {
-        return false;
-      }
-    }
-    else if (map->keys[idx].result_type == RESULT_ACTION)
+    for (guint64 bits = present[word]; bits != 0; bits &= bits - 1)
     {
+      int idx = word * 64 + lowest_bit (bits);
+      if (map->base && flat[idx] == inherited[idx])
+        continue;
+
+      const char *attr = RESULT_TYPE (flat[idx]) == RESULT_ACTION ? "action" : "output";
       if (!out_printf (out, error,
-                       "      <key code=\"%d\" action=\"%s\" />\n",
-                       idx, map->keys[idx].content))
+                       "      <key code=\"%d\" %s=\"%s\" />\n",
+                       idx, attr, str_table_lookup (strings, RESULT_CONTENT (flat[idx]))))
       {
         return false;
       }
@@ -349,19 +506,109 @@ key_map_write (KeyMap *map, Out *out, GError **error)
 bool
 key_maps_eq (KeyMap *lhs, KeyMap *rhs)
 {
+  Result lhs_flat[128];
+  Result rhs_flat[128];
+  guint64 lhs_present[2];
+  guint64 rhs_present[2];
+  key_map_flatten (lhs, lhs_flat, lhs_present);
+  key_map_flatten (rhs, rhs_flat, rhs_present);
+
+  // no branches in the loop, so it can be vectorised
+  guint32 differ = 0;
   for (int idx = 0; idx < 128; ++idx)
+    differ |= (lhs_flat[idx] != rhs_flat[idx]) & (lhs_flat[idx] != 0) & (rhs_flat[idx] != 0);
+
+  return differ == 0;
+}
+
+guint
+key_map_hash (const KeyMap *map)
+{
+  Result flat[128];
+  guint64 present[2];
+  key_map_flatten (map, flat, present);
+
+  guint hash = 5381;
+  for (int idx = 0; idx < 128; ++idx)
+    hash = hash * 33 + flat[idx];
+
+  return hash;
+}
+
+// how many keys have to be written for map if it inherits from base, or
+// -1 if it can't, because base has a key that map doesn't
+int
+key_map_count_changes (KeyMap *map, KeyMap *base)
+{
+  Result flat[128];
+  Result inherited[128];
+  guint64 present[2];
+  guint64 base_present[2];
+  key_map_flatten (map, flat, present);
+  key_map_flatten (base, inherited, base_present);
+
+  if ((base_present[0] & ~present[0]) != 0 || (base_present[1] & ~present[1]) != 0)
+    return -1;
+
+  int count = 0;
+  for (int word = 0; word < 2; ++word)
   {
-    if (lhs->keys[idx].result_type != NO_RESULT && rhs->keys[idx].result_type != NO_RESULT)
+    for (guint64 bits = present[word]; bits != 0; bits &= bits - 1)
     {
-      if (lhs->keys[idx].result_type != rhs->keys[idx].result_type
-          || strcmp (lhs->keys[idx].content, rhs->keys[idx].content) != 0)
-      {
-        return false;
-      }
+      int idx = word * 64 + lowest_bit (bits);
+      if (flat[idx] != inherited[idx])
+        ++count;
     }
   }
 
-  return true;
+  return count;
+}
+
+int
+key_maps_compare_index (const void *lhs, const void *rhs)
+{
+  return (*(KeyMap *const *)lhs)->index - (*(KeyMap *const *)rhs)->index;
+}
+
+// unlike key_maps_eq, a key that's missing only matches a missing key
+gboolean
+key_maps_identical (const KeyMap *lhs, const KeyMap *rhs)
+{
+  Result lhs_flat[128];
+  Result rhs_flat[128];
+  guint64 lhs_present[2];
+  guint64 rhs_present[2];
+  key_map_flatten (lhs, lhs_flat, lhs_present);
+  key_map_flatten (rhs, rhs_flat, rhs_present);
+
+  return memcmp (lhs_flat, rhs_flat, sizeof lhs_flat) == 0;
+}
+
+int
+count_bits (guint64 bits)
+{
+#if defined(__GNUC__)
+  return __builtin_popcountll (bits);
+#else
+  int count = 0;
+  for (; bits != 0; bits &= bits - 1)
+    ++count;
+  return count;
+#endif
+}
+
+int
+lowest_bit (guint64 bits)
+{
+  g_assert (bits != 0);
+#if defined(__GNUC__)
+  return __builtin_ctzll (bits);
+#else
+  int bit = 0;
+  for (; (bits & 1) == 0; bits >>= 1)
+    ++bit;
+  return bit;
+#endif
 }
 
 /**
@@ -369,14 +616,44 @@ key_maps_eq (KeyMap *lhs, KeyMap *rhs)
  */
 
 KeyMapSet *
-key_map_set_new (bool is_control, bool capslock_disables)
+key_map_set_new (Arena *arena, StrTable *strings, bool is_control, bool capslock_disables)
 {
-  KeyMapSet *set = g_slice_alloc0 (sizeof (KeyMapSet));
+  KeyMapSet *set = arena_alloc0 (arena, sizeof (KeyMapSet));
 
+  set->arena = arena;
+  set->strings = strings;
   set->is_control = is_control;
   set->capslock_disables = capslock_disables;
 
-  set->plain_maps = key_map_subset_new (is_control, false, capslock_disables);
+  set->plain_maps = key_map_subset_new (arena, is_control, false, capslock_disables);
+
+  return set;
+}
+
+void
+key_map_set_freeze (KeyMapSet *set)
+{
+  key_map_subset_freeze (set->plain_maps);
+  if (set->opt_maps)
+    key_map_subset_freeze (set->opt_maps);
+  if (set->backup_maps)
+    key_map_subset_freeze (set->backup_maps);
+}
+
+KeyMapSet *
+key_map_set_clone (const KeyMapSet *src, Arena *arena, StrTable *strings)
+{
+  KeyMapSet *set = arena_alloc (arena, sizeof (KeyMapSet));
+  *set = *src;
+
+  set->arena = arena;
+  set->strings = strings;
+  set->plain_maps = key_map_subset_clone (src->plain_maps, arena);
+  set->opt_maps = src->opt_maps ? key_map_subset_clone (src->opt_maps, arena) : NULL;
+  set->backup_maps = src->backup_maps ? key_map_subset_clone (src->backup_maps, arena) : NULL;
+
+  if (src->plain_maps->backup_map)
+    key_map_subset_set_backup (set->plain_maps, set->backup_maps->shiftless_map);
 
   return set;
 }
@@ -384,16 +661,15 @@ key_map_set_new (bool is_control, bool capslock_disables)
 void
 key_map_set_set_result (KeyMapSet *set, int mods, int shift_state, int code, int result_type, const char *content)
 {
-  Result *result = key_map_set_lookup_result (set, mods, shift_state, code);
-  result->result_type = result_type;
-  result->content = content;
+  key_map_set_result (key_map_set_lookup_map (set, mods, shift_state), code,
+                      RESULT_PACK (result_type, str_table_intern (set->strings, content)), set->arena);
   set->dirty = true;
 }
 
-const Result *
+Result
 key_map_set_get_result (KeyMapSet *set, int mods, int shift_state, int code)
 {
-  return key_map_set_lookup_result (set, mods, shift_state, code);
+  return key_map_get_result (key_map_set_lookup_map (set, mods, shift_state), code);
 }
 
 void
@@ -418,34 +694,68 @@ key_map_set_make_backup (KeyMapSet *set)
   set->dirty = false;
 }
 
-void
-key_map_set_assign_mods (KeyMapSet *set, int *index)
+GHashTable *
+key_map_table_new ()
 {
-  const char *required;
-  const char *permitted;
+  return g_hash_table_new ((GHashFunc)key_map_hash, (GEqualFunc)key_maps_identical);
+}
 
-  required = set->is_control ? " control" : "";
-  if (set->opt_maps)
-    permitted = set->capslock_disables && !set->dirty ? " caps?" : "";
-  else
-    permitted = set->capslock_disables && !set->dirty ? " anyOption? caps?" : " anyOption?";
+void
+key_map_table_choose_bases (GHashTable *maps)
+{
+  // only maps that get written at all are in the table
+  GPtrArray *written = g_ptr_array_new ();
+  GHashTableIter iter;
+  void *map;
+  g_hash_table_iter_init (&iter, maps);
+  while (g_hash_table_iter_next (&iter, &map, NULL))
+    g_ptr_array_add (written, map);
+  g_ptr_array_sort (written, key_maps_compare_index);
+
+  // each map can inherit from an earlier one that's written in full, so
+  // there are never chains of bases
+  for (guint idx = 1; idx < written->len; ++idx)
+  {
+    KeyMap *map = g_ptr_array_index (written, idx);
 
-  key_map_subset_assign_mods (set->plain_maps, required, permitted, index);
+    Result flat[128];
+    guint64 present[2];
+    key_map_flatten (map, flat, present);
+    int best = count_bits (present[0]) + count_bits (present[1]); // writing it in full
 
-  permitted = set->capslock_disables && !set->dirty ? " caps?" : "";
-  
-  if (set->opt_maps)
-  {
-    required = set->is_control ? " control anyOption" : " anyOption";
+    for (guint other = 0; other < idx; ++other)
+    {
+      KeyMap *base = g_ptr_array_index (written, other);
+      if (base->base)
+        continue;
 
-    key_map_subset_assign_mods (set->opt_maps, required, permitted, index);
+      int count = key_map_count_changes (map, base);
+      if (count >= 0 && count < best)
+      {
+        best = count;
+        map->base = base;
+      }
+    }
   }
 
+  g_ptr_array_free (written, TRUE);
+}
+
+void
+key_map_set_assign_mods (KeyMapSet *set, int *index, GHashTable *maps)
+{
+  int control = set->is_control ? MODIFIER_CONTROL : 0;
+  int caps = set->capslock_disables && !set->dirty ? MODIFIER_CAPS : 0;
+
+  key_map_subset_assign_mods (set->plain_maps, control, caps | (set->opt_maps ? 0 : MODIFIER_OPTION), index, maps);
+
+  if (set->opt_maps)
+    key_map_subset_assign_mods (set->opt_maps, control | MODIFIER_OPTION, caps, index, maps);
+
   if (set->capslock_disables && set->dirty)
   {
     // need to output the backup
-    required = set->is_control ? " caps control" : " caps";
-    key_map_subset_assign_mods (set->backup_maps, required, " anyOption?", index);
+    key_map_subset_assign_mods (set->backup_maps, control | MODIFIER_CAPS, MODIFIER_OPTION, index, maps);
   }
 }
 
@@ -465,9 +775,9 @@ key_map_set_write_mods (KeyMapSet *set, Out *out, GError **error)
 bool
 key_map_set_write_maps (KeyMapSet *set, Out *out, GError **error)
 {
-  if (!key_map_subset_write_maps (set->plain_maps, out, error)
-      || (set->opt_maps && !key_map_subset_write_maps (set->opt_maps, out, error))
-      || (set->capslock_disables && set->dirty && !key_map_subset_write_maps (set->backup_maps, out, error)))
+  if (!key_map_subset_write_maps (set->plain_maps, set->strings, out, error)
+      || (set->opt_maps && !key_map_subset_write_maps (set->opt_maps, set->strings, out, error))
+      || (set->capslock_disables && set->dirty && !key_map_subset_write_maps (set->backup_maps, set->strings, out, error)))
   {
     return false;
   }
@@ -2,12 +2,16 @@
 #define OSX_KB_KEYMAP_H
 
 #include "common.h"
+#include "arena.h"
+#include "modifiers.h"
 #include "out.h"
+#include "strtable.h"
 
 typedef struct _KeyMap KeyMap;
 typedef struct _KeyMapSet KeyMapSet;
 typedef struct _KeyMapSubset KeyMapSubset;
-typedef struct _Result Result;
+
+#define KEY_MAP_SET_ID "maps" // the id of the one keyMapSet in a keylayout
 
 enum
   {
@@ -32,6 +36,8 @@ enum
 
 struct _KeyMapSet
 {
+  Arena *arena; // the keyboard's, which owns the maps and everything in them
+  StrTable *strings; // the keyboard's, for every result content
   bool is_control;
   bool capslock_disables;
   bool active_capslock;
@@ -45,6 +51,7 @@ struct _KeyMapSet
 
 struct _KeyMapSubset
 {
+  Arena *arena;
   bool is_control;
   bool is_option;
   bool capslock_disables;
@@ -56,27 +63,53 @@ struct _KeyMapSubset
   KeyMap *backup_map; // only when is_control
 };
 
-struct _Result
-{
-  int result_type;
-  const char *content;
-};
+/**
+ * A result is packed into 32 bits: its type in the top two, above the id
+ * of its content in the set's string table. A missing result is 0.
+ */
+
+typedef guint32 Result;
+
+#define RESULT_PACK(type, content) (((guint32)(type) << 30) | (content))
+#define RESULT_TYPE(result) ((int)((result) >> 30))
+#define RESULT_CONTENT(result) ((result) & STR_TABLE_MAX_ID)
+
+/**
+ * KeyMaps are copy-on-write. A copy starts out empty, reading through to a
+ * parent layer, and only stores the keys that are written to it: present
+ * has a bit for each of those, and entries holds them in code order. When
+ * a map with entries of its own is copied, those entries move into a new
+ * layer that becomes the parent of both, so a parent is never written to.
+ */
 
 struct _KeyMap
 {
-  Result keys[128];
-  GList *mods;
+  KeyMap *parent;
+  guint64 present[2];
+  Result *entries;
+  int n_entries;
+
+  ModifierStates mods; // the states this map is selected by
   int index;
+  KeyMap *shared; // an identical map that gets written in this one's place
+  KeyMap *base; // if set, only the keys that differ from it get written
 };
 
-KeyMapSet *key_map_set_new (bool is_control, bool capslock_disables);
+KeyMapSet *key_map_set_new (Arena *arena, StrTable *strings, bool is_control, bool capslock_disables);
+
+// once frozen, a set is only read, and clones of it (which can be written
+// to) cost a few small allocations, whichever thread makes them
+void key_map_set_freeze (KeyMapSet *set);
+KeyMapSet *key_map_set_clone (const KeyMapSet *src, Arena *arena, StrTable *strings);
 
 void key_map_set_set_result (KeyMapSet *set, int mods, int shift_state, int code, int result_type, const char *content);
-const Result *key_map_set_get_result (KeyMapSet *set, int mods, int shift_state, int code);
+Result key_map_set_get_result (KeyMapSet *set, int mods, int shift_state, int code);
 
 void key_map_set_maybe_unshift (KeyMapSet *set);
 void key_map_set_make_backup (KeyMapSet *set);
-void key_map_set_assign_mods (KeyMapSet *set, int *index);
+GHashTable *key_map_table_new (void); // for finding identical maps across sets
+void key_map_set_assign_mods (KeyMapSet *set, int *index, GHashTable *maps);
+void key_map_table_choose_bases (GHashTable *maps); // once all the maps are in
 
 bool key_map_set_write_mods (KeyMapSet *set, Out *out, GError **error);
 bool key_map_set_write_maps (KeyMapSet *set, Out *out, GError **error);
@@ -5,6 +5,7 @@
 
 static void print_help (const char *program) G_GNUC_NORETURN;
 static void print_version (void) G_GNUC_NORETURN;
+static bool parse_jobs (guint *jobs, const char *arg, GError **error);
 
 void
 print_help (const char *program_path)
@@ -14,8 +15,9 @@ print_help (const char *program_path)
   g_object_unref (file);
 
   fprintf (stderr,
-           "Usage: %s CONFIG_FILE\n"
+           "Usage: %s [OPTION]... CONFIG_FILE\n"
            "Options:\n"
+           "  --jobs N, -j N                 build and write up to N keyboards at once\n"
            "  --help, -h, -?                 print this help and exit\n"
            "  --version, -v                  print version information and exit\n"
            "Creates an OSX bundle defining one or more keyboard layouts.\n"
@@ -38,16 +40,28 @@ print_version ()
   exit (0);
 }
 
+bool
+parse_jobs (guint *jobs, const char *arg, GError **error)
+{
+  if (arg == NULL)
+    return make_error (error, "Missing number of jobs");
+
+  char *end;
+  unsigned long n = strtoul (arg, &end, 10);
+  if (end == arg || *end != '\0' || n < 1 || n > G_MAXINT)
+    return make_error (error, "Bad number of jobs: %s", arg);
+
+  *jobs = (guint)n;
+  return true;
+}
+
 int
 main (int argc, char **argv)
 {
   GError *error = NULL;
 
-#if !GLIB_CHECK_VERSION(2,35,0)
-  g_type_init ();
-#endif
-
   const char *config_file = NULL;
+  guint jobs = 1;
   for (int idx = 1; idx < argc; ++idx)
   {
     const char *arg = argv[idx];
@@ -64,6 +78,12 @@ main (int argc, char **argv)
         {
           print_version ();
         }
+        else if (strcmp (arg, "jobs") == 0)
+        {
+          ++idx;
+          if (!parse_jobs (&jobs, argv[idx], &error))
+            goto on_error;
+        }
         else
         {
           make_error (&error, "Unknown option: %s", argv[idx]);
@@ -80,6 +100,12 @@ main (int argc, char **argv)
         {
           print_version ();
         }
+        else if (arg[1] == 'j')
+        {
+          ++idx;
+          if (!parse_jobs (&jobs, argv[idx], &error))
+            goto on_error;
+        }
         else
         {
           make_error (&error, "Unknown option: %s", argv[idx]);
@@ -104,7 +130,7 @@ main (int argc, char **argv)
     goto on_error;
   }
 
-  Bundle *bundle = bundle_new (config_file, &error);
+  Bundle *bundle = bundle_new (config_file, jobs, &error);
   if (bundle == NULL
       || !bundle_load_data (bundle, &error)
       || !bundle_write_bundle (bundle, &error))
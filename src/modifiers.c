@@ -0,0 +1,169 @@
+#include "modifiers.h"
+#include <string.h>
+
+typedef struct _Cube Cube;
+
+enum
+  {
+    N_CUBES = 243 // 3 ** MODIFIER_N_KEYS
+  };
+
+struct _Cube
+{
+  int care; // the keys whose state matters
+  int down; // which of those must be down
+  ModifierStates states;
+};
+
+static const char *const KEY_NAMES[MODIFIER_N_KEYS] =
+  {
+    "anyShift", "caps", "anyOption", "command", "control"
+  };
+
+static int find_primes (ModifierStates states, Cube *primes);
+static void find_cover (const Cube *primes, int n_primes, ModifierStates uncovered,
+                        int *chosen, int n_chosen, int *best, int *n_best);
+
+static bool cube_write (const Cube *cube, Out *out, GError **error);
+
+/**
+ * Private procedures
+ */
+
+// the cubes that lie within states and aren't within any bigger one
+int
+find_primes (ModifierStates states, Cube *primes)
+{
+  int n_primes = 0;
+  for (int care = 0; care < 1 << MODIFIER_N_KEYS; ++care)
+  {
+    for (int down = care; ; down = (down - 1) & care)
+    {
+      int required = down;
+      int permitted = ~care & ((1 << MODIFIER_N_KEYS) - 1);
+      ModifierStates cube_states = modifier_states (required, permitted);
+      if ((cube_states & ~states) == 0)
+      {
+        // prime unless letting go of one of its keys still fits
+        bool prime = true;
+        for (int key = 1; key < 1 << MODIFIER_N_KEYS && prime; key <<= 1)
+        {
+          if ((care & key) != 0
+              && (modifier_states (required & ~key, permitted | key) & ~states) == 0)
+          {
+            prime = false;
+          }
+        }
+
+        if (prime)
+        {
+          primes[n_primes].care = care;
+          primes[n_primes].down = down;
+          primes[n_primes].states = cube_states;
+          ++n_primes;
+        }
+      }
+
+      if (down == 0)
+        break;
+    }
+  }
+
+  return n_primes;
+}
+
+// a smallest set of primes covering uncovered, by branching on whichever
+// prime covers its lowest state
+void
+find_cover (const Cube *primes, int n_primes, ModifierStates uncovered,
+            int *chosen, int n_chosen, int *best, int *n_best)
+{
+  if (uncovered == 0)
+  {
+    memcpy (best, chosen, (size_t)n_chosen * sizeof (int));
+    *n_best = n_chosen;
+    return;
+  }
+
+  if (n_chosen + 1 >= *n_best)
+    return;
+
+  ModifierStates lowest = uncovered & (~uncovered + 1);
+  for (int idx = 0; idx < n_primes; ++idx)
+  {
+    if ((primes[idx].states & lowest) != 0)
+    {
+      chosen[n_chosen] = idx;
+      find_cover (primes, n_primes, uncovered & ~primes[idx].states, chosen, n_chosen + 1, best, n_best);
+    }
+  }
+}
+
+bool
+cube_write (const Cube *cube, Out *out, GError **error)
+{
+  if (!out_print (out, error, "      <modifier keys=\""))
+    return false;
+
+  bool first = true;
+  for (int idx = 0; idx < MODIFIER_N_KEYS; ++idx)
+  {
+    int key = 1 << idx;
+    if ((cube->care & key) != 0 && (cube->down & key) == 0)
+      continue; // up
+
+    if (!out_printf (out, error, "%s%s%s",
+                     first ? "" : " ", KEY_NAMES[idx], (cube->care & key) != 0 ? "" : "?"))
+    {
+      return false;
+    }
+    first = false;
+  }
+
+  return out_print (out, error, "\" />\n");
+}
+
+/**
+ * Public procedures
+ */
+
+ModifierStates
+modifier_states (int required, int permitted)
+{
+  ModifierStates states = 0;
+  for (int state = 0; state < 1 << MODIFIER_N_KEYS; ++state)
+  {
+    if ((state & required) == required && (state & ~(required | permitted)) == 0)
+      states |= (ModifierStates)1 << state;
+  }
+
+  return states;
+}
+
+bool
+modifier_states_write (ModifierStates states, Out *out, GError **error)
+{
+  if (states == 0)
+    return true;
+
+  Cube primes[N_CUBES];
+  int n_primes = find_primes (states, primes);
+
+  int chosen[1 << MODIFIER_N_KEYS];
+  int best[1 << MODIFIER_N_KEYS];
+  int n_best = (1 << MODIFIER_N_KEYS) + 1; // worse than any cover
+  find_cover (primes, n_primes, states, chosen, 0, best, &n_best);
+
+  // in the order the primes were found, so the output is stable
+  bool used[N_CUBES] = { false };
+  for (int idx = 0; idx < n_best; ++idx)
+    used[best[idx]] = true;
+
+  for (int idx = 0; idx < n_primes; ++idx)
+  {
+    if (used[idx] && !cube_write (&primes[idx], out, error))
+      return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,34 @@
+#ifndef OSX_KB_MODIFIERS_H
+#define OSX_KB_MODIFIERS_H
+
+#include "common.h"
+#include "out.h"
+
+/**
+ * The modifier keys a keyMapSelect can test, each either down or up, give
+ * 32 modifier states. The states a keyMap is selected by are kept as a set
+ * of those (bit s for state s), and only turned into <modifier keys="..." />
+ * lines when written, as a smallest set of cubes (each key down, up, or
+ * either) whose union is exactly that set.
+ */
+
+enum
+  {
+    MODIFIER_SHIFT = 1 << 0,
+    MODIFIER_CAPS = 1 << 1,
+    MODIFIER_OPTION = 1 << 2,
+    MODIFIER_COMMAND = 1 << 3,
+    MODIFIER_CONTROL = 1 << 4,
+
+    MODIFIER_N_KEYS = 5
+  };
+
+typedef guint32 ModifierStates;
+
+// the states with every required key down, and every key that's neither
+// required nor permitted up
+ModifierStates modifier_states (int required, int permitted);
+
+bool modifier_states_write (ModifierStates states, Out *out, GError **error);
+
+#endif
@@ -1,168 +1,570 @@
 #include "prefixmap.h"
+#include <stdlib.h>
+#include <string.h>
 
-static void prefix_map_init (PrefixMap *map);
+static guint32 prefix_map_alloc_run (PrefixMap *map, int size);
+static void prefix_map_release_run (PrefixMap *map, guint32 run, int size);
 
-void
-prefix_map_init (PrefixMap *map)
-{
-  map->capacity = 8;
-  map->children = g_malloc (map->capacity * sizeof (PrefixNode));
-  map->n_children = 0;
-}
+static guint32 prefix_map_find_child (PrefixMap *map, guint32 parent, guint32 c, guint32 *index);
+static guint32 prefix_map_find_frozen_child (PrefixMap *map, guint32 parent, guint32 c);
+static guint32 prefix_map_insert_child (PrefixMap *map, guint32 parent, guint32 index, guint32 c);
+
+static int next_key (const char *str, const char *end, bool utf8, guint32 *c);
+static void prefix_map_check_mode (PrefixMap *map, bool utf8, bool inserting);
+
+static void **prefix_map_insert (PrefixMap *map, const char *key, bool utf8);
+static void *prefix_map_find (PrefixMap *map, const char *key, bool utf8);
+static void *prefix_map_find_prefix (PrefixMap *map, const char **key, const char *end, bool utf8);
+static int compare_keys (const void *lhs, const void *rhs);
+static void prefix_map_build_node (PrefixMap *map, guint32 node, const char **keys, void **data, guint n_keys, size_t depth);
+
+static void prefix_map_foreach_node (PrefixMap *map, guint32 node, GArray *key, PrefixMapFunc func, void *userdata);
+
+static const guint32 INITIAL_CAPACITY = 64;
+static const guint32 INVALID_UTF8 = 0x80000000;
 
 /**
- * Public procedures
+ * Private procedures
  */
 
-PrefixMap *
-prefix_map_new ()
+// a run of 1 << size nodes, taken from the free list if there's one going
+guint32
+prefix_map_alloc_run (PrefixMap *map, int size)
 {
-  PrefixMap *map = g_slice_alloc0 (sizeof (PrefixMap));
+  g_assert (size < PREFIX_MAP_N_SIZES);
 
-  prefix_map_init (map);
+  guint32 run = map->free_runs[size];
+  if (run != 0)
+  {
+    map->free_runs[size] = map->nodes[run].children; // free runs are chained through their first node
+    return run;
+  }
 
-  return map;
+  guint32 n_nodes = (guint32)1 << size;
+  if (map->n_nodes + n_nodes > map->capacity)
+  {
+    while (map->n_nodes + n_nodes > map->capacity)
+      map->capacity *= 2;
+    map->nodes = g_realloc (map->nodes, map->capacity * sizeof (PrefixNode));
+  }
+
+  run = map->n_nodes;
+  map->n_nodes += n_nodes;
+  return run;
 }
 
-void **
-prefix_map_lookup (PrefixMap *map, const char *key)
+void
+prefix_map_release_run (PrefixMap *map, guint32 run, int size)
 {
-  g_assert (*key != '\0');
+  map->nodes[run].children = map->free_runs[size];
+  map->free_runs[size] = run;
+}
 
-  char c = *key;
+// returns the index of the child keyed by c, or 0 if there isn't one, in
+// which case *index is where it should be inserted among its siblings
+guint32
+prefix_map_find_child (PrefixMap *map, guint32 parent, guint32 c, guint32 *index)
+{
+  const PrefixNode *children = map->nodes + map->nodes[parent].children;
 
   int low = 0;
-  int high = map->n_children - 1;
-  int mid = 0;
-  int cmp = -1; // so index ends up as 0 when the map is empty
+  int high = (int)map->nodes[parent].n_children - 1;
   while (low <= high)
   {
-    mid = (low + high) / 2;
-    cmp = c - map->children[mid].key;
-    if (cmp < 0)
-    {
+    int mid = (low + high) / 2;
+    if (c < children[mid].key)
       high = mid - 1;
-    }
-    else if (cmp > 0)
-    {
+    else if (c > children[mid].key)
+      low = mid + 1;
+    else
+      return map->nodes[parent].children + (guint32)mid;
+  }
+
+  if (index)
+    *index = (guint32)low;
+  return 0;
+}
+
+// the same, but searching the packed keys of a frozen map
+guint32
+prefix_map_find_frozen_child (PrefixMap *map, guint32 parent, guint32 c)
+{
+  guint32 first = map->nodes[parent].children;
+  const guint32 *keys = map->keys + first;
+
+  int low = 0;
+  int high = (int)map->nodes[parent].n_children - 1;
+  while (low <= high)
+  {
+    int mid = (low + high) / 2;
+    if (c < keys[mid])
+      high = mid - 1;
+    else if (c > keys[mid])
       low = mid + 1;
-    }
     else
+      return first + (guint32)mid;
+  }
+
+  return 0;
+}
+
+// returns the index of the new child; any pointers into map->nodes are
+// invalid afterwards
+guint32
+prefix_map_insert_child (PrefixMap *map, guint32 parent, guint32 index, guint32 c)
+{
+  PrefixNode *node = map->nodes + parent;
+  if (node->n_children == node->capacity)
+  {
+    int size = node->capacity == 0 ? 0 : g_bit_nth_msf (node->capacity, -1) + 1;
+    guint32 run = prefix_map_alloc_run (map, size);
+
+    node = map->nodes + parent;
+    if (node->capacity > 0)
     {
-      if (key[1] == '\0')
-        return &map->children[mid].data;
-      
-      return prefix_map_lookup (&map->children[mid].submap, key + 1);
+      memcpy (map->nodes + run, map->nodes + node->children, node->n_children * sizeof (PrefixNode));
+      prefix_map_release_run (map, node->children, size - 1);
     }
+    node->children = run;
+    node->capacity = (guint32)1 << size;
   }
 
-  // not there, have to insert a position for it
-  // it should go either right before or right after mid
+  PrefixNode *children = map->nodes + node->children;
+  memmove (children + index + 1, children + index, (node->n_children - index) * sizeof (PrefixNode));
+  node->n_children += 1;
+
+  PrefixNode *child = children + index;
+  child->key = c;
+  child->data = NULL;
+  child->children = 0;
+  child->n_children = 0;
+  child->capacity = 0;
+
+  return node->children + index;
+}
 
-  int index = cmp < 0 ? mid : mid + 1;
-  if (map->n_children == map->capacity)
+// reads one key off str, either a byte or a whole UTF-8 sequence, and
+// returns its length in bytes; bytes that don't start a well-formed
+// sequence are keyed on their own, well away from any code point. A
+// sequence stops at end, or at the NUL if end is NULL
+int
+next_key (const char *str, const char *end, bool utf8, guint32 *c)
+{
+  const guchar *s = (const guchar *)str;
+  if (!utf8 || s[0] < 0x80)
   {
-    map->capacity *= 2;
-    map->children = g_realloc (map->children, map->capacity * sizeof (PrefixNode));
+    *c = s[0];
+    return 1;
   }
 
-  for (int i = map->n_children; i > index; --i)
-    map->children[i] = map->children[i-1];
-
-  while (true)
+  int len;
+  guint32 min;
+  guint32 cp;
+  if ((s[0] & 0xe0) == 0xc0)
   {
-    map->n_children += 1;
-    map->children[index].key = *key;
-    map->children[index].data = NULL;
-    prefix_map_init (&map->children[index].submap);
+    len = 2;
+    min = 0x80;
+    cp = s[0] & 0x1f;
+  }
+  else if ((s[0] & 0xf0) == 0xe0)
+  {
+    len = 3;
+    min = 0x800;
+    cp = s[0] & 0x0f;
+  }
+  else if ((s[0] & 0xf8) == 0xf0)
+  {
+    len = 4;
+    min = 0x10000;
+    cp = s[0] & 0x07;
+  }
+  else
+  {
+    len = 0;
+    min = 0;
+    cp = 0;
+  }
 
-    if (key[1] == '\0')
+  if (end != NULL && (const char *)s + len > end)
+    len = 0;
+
+  for (int idx = 1; idx < len; ++idx)
+  {
+    if ((s[idx] & 0xc0) != 0x80) // this also stops at the terminating NUL
+    {
+      len = 0;
       break;
+    }
+    cp = (cp << 6) | (s[idx] & 0x3f);
+  }
 
-    map = &map->children[index].submap; // which has just been initted, so has space for a child at index = 0
-    index = 0;
-    ++key;
+  if (len == 0 || cp < min || cp > 0x10ffff)
+  {
+    *c = INVALID_UTF8 | s[0];
+    return 1;
   }
 
-  return &map->children[index].data;  
+  *c = cp;
+  return len;
+}
+
+// the first key fixes the mode, and everything after has to stick to it
+void
+prefix_map_check_mode (PrefixMap *map, bool utf8, bool inserting)
+{
+  int mode = utf8 ? PREFIX_MAP_UTF8_KEYS : PREFIX_MAP_BYTE_KEYS;
+  if (map->key_mode == PREFIX_MAP_NO_KEYS && inserting)
+    map->key_mode = mode;
+
+  g_assert (map->key_mode == PREFIX_MAP_NO_KEYS || map->key_mode == mode);
+}
+
+void **
+prefix_map_insert (PrefixMap *map, const char *key, bool utf8)
+{
+  g_assert (*key != '\0');
+  g_assert (map->keys == NULL);
+  prefix_map_check_mode (map, utf8, true);
+
+  guint32 node = 0;
+  const char *ptr = key;
+  while (*ptr)
+  {
+    guint32 c;
+    ptr += next_key (ptr, NULL, utf8, &c);
+
+    guint32 index;
+    guint32 child = prefix_map_find_child (map, node, c, &index);
+    if (child == 0)
+      child = prefix_map_insert_child (map, node, index, c);
+    node = child;
+  }
+
+  return &map->nodes[node].data;
 }
 
 void *
-prefix_map_get (PrefixMap *map, const char *key)
+prefix_map_find (PrefixMap *map, const char *key, bool utf8)
 {
   g_assert (*key != '\0');
+  prefix_map_check_mode (map, utf8, false);
 
-  char c = *key;
+  guint32 node = 0;
+  const char *ptr = key;
+  while (*ptr)
+  {
+    guint32 c;
+    ptr += next_key (ptr, NULL, utf8, &c);
 
-  int low = 0;
-  int high = map->n_children - 1;
-  while (low <= high)
+    if (map->keys)
+      node = prefix_map_find_frozen_child (map, node, c);
+    else
+      node = prefix_map_find_child (map, node, c, NULL);
+    if (node == 0)
+      return NULL;
+  }
+
+  return map->nodes[node].data;
+}
+
+void *
+prefix_map_find_prefix (PrefixMap *map, const char **key, const char *end, bool utf8)
+{
+  g_assert (*key != end);
+  prefix_map_check_mode (map, utf8, false);
+
+  void *ret = NULL;
+  guint32 node = 0;
+  const char *ptr = *key;
+  while (ptr != end && *ptr)
   {
-    int mid = (low + high) / 2;
-    int cmp = c - map->children[mid].key;
-    if (cmp < 0)
-    {
-      high = mid - 1;
-    }
-    else if (cmp > 0)
-    {
-      low = mid + 1;
-    }
+    guint32 c;
+    ptr += next_key (ptr, end, utf8, &c);
+
+    if (map->keys)
+      node = prefix_map_find_frozen_child (map, node, c);
     else
+      node = prefix_map_find_child (map, node, c, NULL);
+    if (node == 0)
+      break;
+
+    if (map->nodes[node].data != NULL)
     {
-      if (key[1] == '\0')
-        return map->children[mid].data;
-      
-      return prefix_map_get (&map->children[mid].submap, key + 1);
+      ret = map->nodes[node].data;
+      *key = ptr;
     }
   }
 
-  return NULL;
+  return ret;
 }
 
-void *
-prefix_map_get_prefix (PrefixMap *map, const char **key)
+// orders UTF-8 keys the way their nodes will be ordered, which for
+// well-formed UTF-8 is the same as strcmp
+int
+compare_keys (const void *lhs, const void *rhs)
 {
-  g_assert (**key != '\0');
+  const char *l = *(const char *const *)lhs;
+  const char *r = *(const char *const *)rhs;
+  while (*l && *r)
+  {
+    guint32 lc;
+    guint32 rc;
+    l += next_key (l, NULL, true, &lc);
+    r += next_key (r, NULL, true, &rc);
+    if (lc != rc)
+      return lc < rc ? -1 : 1;
+  }
 
-  const char *ptr = *key;
-  char c = *ptr;
+  return (*l != '\0') - (*r != '\0');
+}
 
-  int low = 0;
-  int high = map->n_children - 1;
-  while (low <= high)
+// keys are sorted, and all share their first depth bytes, which are the
+// path to node; the keys that end there come first
+void
+prefix_map_build_node (PrefixMap *map, guint32 node, const char **keys, void **data, guint n_keys, size_t depth)
+{
+  guint first = 0;
+  while (first < n_keys && keys[first][depth] == '\0')
   {
-    int mid = (low + high) / 2;
-    int cmp = c - map->children[mid].key;
-    if (cmp < 0)
+    map->nodes[node].data = data[first]; // there should only be one
+    ++first;
+  }
+
+  // count the children, so the run can be exactly the right size
+  guint32 n_children = 0;
+  guint32 last = 0;
+  for (guint idx = first; idx < n_keys; ++idx)
+  {
+    guint32 c;
+    next_key (keys[idx] + depth, NULL, true, &c);
+    if (idx == first || c != last)
+      ++n_children;
+    last = c;
+  }
+
+  if (n_children == 0)
+    return;
+
+  guint32 run = map->n_nodes;
+  map->n_nodes += n_children;
+  map->nodes[node].children = run;
+  map->nodes[node].n_children = n_children;
+  map->nodes[node].capacity = n_children;
+
+  guint idx = first;
+  for (guint32 child = run; child < run + n_children; ++child)
+  {
+    guint32 c;
+    int len = next_key (keys[idx] + depth, NULL, true, &c);
+
+    guint end = idx + 1;
+    while (end < n_keys)
     {
-      high = mid - 1;
+      guint32 other;
+      next_key (keys[end] + depth, NULL, true, &other);
+      if (other != c)
+        break;
+      ++end;
     }
-    else if (cmp > 0)
+
+    map->nodes[child].key = c;
+    map->nodes[child].data = NULL;
+    map->nodes[child].children = 0;
+    map->nodes[child].n_children = 0;
+    map->nodes[child].capacity = 0;
+
+    prefix_map_build_node (map, child, keys + idx, data + idx, end - idx, depth + (size_t)len);
+    idx = end;
+  }
+}
+
+void
+prefix_map_foreach_node (PrefixMap *map, guint32 node, GArray *key, PrefixMapFunc func, void *userdata)
+{
+  guint len = key->len;
+  if (map->nodes[node].data)
+    func (key->data, map->nodes[node].data, userdata); // key is zero-terminated
+
+  for (guint32 idx = 0; idx < map->nodes[node].n_children; ++idx)
+  {
+    guint32 child = map->nodes[node].children + idx;
+    guint32 c = map->nodes[child].key;
+
+    char bytes[6];
+    gint n_bytes;
+    if ((c & INVALID_UTF8) != 0)
     {
-      low = mid + 1;
+      bytes[0] = (char)(c & 0xff);
+      n_bytes = 1;
     }
     else
     {
-      ++ptr;
-      if (map->children[mid].data != NULL)
-        *key = ptr;
-      
-      if (*ptr == '\0')
-        return map->children[mid].data;
-
-      void *ret = prefix_map_get_prefix (&map->children[mid].submap, &ptr);
-      if (ret)
-      {
-        *key = ptr;
-        return ret;
-      }
-      else
-      {
-        return map->children[mid].data;
-      }
+      n_bytes = g_unichar_to_utf8 (c, bytes);
     }
+
+    g_array_append_vals (key, bytes, (guint)n_bytes);
+    prefix_map_foreach_node (map, child, key, func, userdata);
+    g_array_set_size (key, len);
+  }
+}
+
+/**
+ * Public procedures
+ */
+
+PrefixMap *
+prefix_map_new ()
+{
+  PrefixMap *map = g_slice_alloc0 (sizeof (PrefixMap));
+
+  map->capacity = INITIAL_CAPACITY;
+  map->nodes = g_malloc (map->capacity * sizeof (PrefixNode));
+  map->n_nodes = 1;
+  memset (map->nodes, '\0', sizeof (PrefixNode)); // the root
+
+  return map;
+}
+
+PrefixMap *
+prefix_map_build_sorted_utf8 (const char **keys, void **data, guint n_keys)
+{
+  // sort (key, data) pairs together
+  struct
+  {
+    const char *key;
+    void *data;
+  } *pairs = g_malloc (n_keys * sizeof (*pairs));
+
+  size_t total = 1;
+  for (guint idx = 0; idx < n_keys; ++idx)
+  {
+    g_assert (*keys[idx] != '\0');
+    pairs[idx].key = keys[idx];
+    pairs[idx].data = data[idx];
+    total += strlen (keys[idx]);
   }
+  qsort (pairs, n_keys, sizeof (*pairs), compare_keys);
+
+  const char **sorted_keys = g_malloc (n_keys * sizeof (char *));
+  void **sorted_data = g_malloc (n_keys * sizeof (void *));
+  for (guint idx = 0; idx < n_keys; ++idx)
+  {
+    sorted_keys[idx] = pairs[idx].key;
+    sorted_data[idx] = pairs[idx].data;
+  }
+  g_free (pairs);
+
+  // there can't be more nodes than bytes in the keys, plus the root
+  PrefixMap *map = g_slice_alloc0 (sizeof (PrefixMap));
+  map->nodes = g_malloc (total * sizeof (PrefixNode));
+  map->n_nodes = 1;
+  memset (map->nodes, '\0', sizeof (PrefixNode));
+  if (n_keys > 0)
+    prefix_map_check_mode (map, true, true);
+
+  prefix_map_build_node (map, 0, sorted_keys, sorted_data, n_keys, 0);
+
+  g_free (sorted_keys);
+  g_free (sorted_data);
+
+  map->capacity = map->n_nodes;
+  map->nodes = g_realloc (map->nodes, map->n_nodes * sizeof (PrefixNode));
+  map->keys = g_malloc (map->n_nodes * sizeof (guint32));
+  for (guint32 idx = 0; idx < map->n_nodes; ++idx)
+    map->keys[idx] = map->nodes[idx].key;
+
+  return map;
+}
+
+void
+prefix_map_free (PrefixMap *map)
+{
+  g_free (map->nodes);
+  g_free (map->keys);
+  g_slice_free1 (sizeof (PrefixMap), map);
+}
+
+void
+prefix_map_freeze (PrefixMap *map)
+{
+  if (map->keys)
+    return;
+
+  // breadth first: order[i] is the old index of the node that ends up at
+  // i; this only visits nodes reachable from the root, so free runs and
+  // unused capacity are left behind
+  guint32 *order = g_malloc (map->n_nodes * sizeof (guint32));
+  guint32 n_nodes = 1;
+  order[0] = 0;
+  for (guint32 idx = 0; idx < n_nodes; ++idx)
+  {
+    const PrefixNode *node = map->nodes + order[idx];
+    for (guint32 c = 0; c < node->n_children; ++c)
+      order[n_nodes++] = node->children + c;
+  }
+
+  PrefixNode *nodes = g_malloc (n_nodes * sizeof (PrefixNode));
+  guint32 *keys = g_malloc (n_nodes * sizeof (guint32));
+  guint32 next = 1;
+  for (guint32 idx = 0; idx < n_nodes; ++idx)
+  {
+    nodes[idx] = map->nodes[order[idx]];
+    keys[idx] = nodes[idx].key;
+    nodes[idx].capacity = nodes[idx].n_children;
+    if (nodes[idx].n_children > 0)
+    {
+      nodes[idx].children = next;
+      next += nodes[idx].n_children;
+    }
+  }
+  g_assert (next == n_nodes);
+
+  g_free (order);
+  g_free (map->nodes);
+
+  map->nodes = nodes;
+  map->keys = keys;
+  map->n_nodes = n_nodes;
+  map->capacity = n_nodes;
+  memset (map->free_runs, '\0', sizeof (map->free_runs));
+}
+
+void **
+prefix_map_lookup (PrefixMap *map, const char *key)
+{
+  return prefix_map_insert (map, key, false);
+}
+
+void *
+prefix_map_get (PrefixMap *map, const char *key)
+{
+  return prefix_map_find (map, key, false);
+}
+
+void **
+prefix_map_lookup_utf8 (PrefixMap *map, const char *key)
+{
+  return prefix_map_insert (map, key, true);
+}
+
+void *
+prefix_map_get_utf8 (PrefixMap *map, const char *key)
+{
+  return prefix_map_find (map, key, true);
+}
+
+void *
+prefix_map_get_prefix_utf8 (PrefixMap *map, const char **key, const char *end)
+{
+  return prefix_map_find_prefix (map, key, end, true);
+}
+
+void
+prefix_map_foreach_utf8 (PrefixMap *map, PrefixMapFunc func, void *userdata)
+{
+  prefix_map_check_mode (map, true, false);
 
-  return NULL;
+  GArray *key = g_array_new (TRUE, FALSE, sizeof (char));
+  prefix_map_foreach_node (map, 0, key, func, userdata);
+  g_array_free (key, TRUE);
 }
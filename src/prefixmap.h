@@ -6,25 +6,71 @@
 typedef struct _PrefixMap PrefixMap;
 typedef struct _PrefixNode PrefixNode;
 
-struct _PrefixMap
-{
-  PrefixNode *children;
-  int n_children;
-  size_t capacity;
-};
+typedef void (*PrefixMapFunc) (const char *key, void *data, void *userdata);
+
+/**
+ * All the nodes of a map live in one block owned by the map, and children
+ * are referred to by their index in that block (0, the root, is never
+ * anybody's child, so it doubles as "no children"). Leaves have no child
+ * array at all. Child arrays grow in powers of two; a run that's been
+ * outgrown goes on a free list for its size and gets reused.
+ *
+ * Once a map is only going to be read, prefix_map_freeze lays the nodes out
+ * again level by level with exact-sized child runs, and copies the keys into
+ * their own array so that a search among siblings stays within a cache line
+ * or two. A frozen map can't be inserted into.
+ *
+ * A map is keyed through either the byte procedures or the _utf8 ones,
+ * whichever its first key went in through. Mixing them isn't allowed,
+ * since bytes 0x80-0xff would get the same keys as U+0080-U+00FF.
+ */
+
+enum
+  {
+    PREFIX_MAP_N_SIZES = 32 // child runs of 1, 2, 4, ... nodes
+  };
+
+enum
+  {
+    PREFIX_MAP_NO_KEYS,
+    PREFIX_MAP_BYTE_KEYS,
+    PREFIX_MAP_UTF8_KEYS
+  };
 
 struct _PrefixNode
 {
-  char key;
   void *data;
-  PrefixMap submap;
+  guint32 children;
+  guint32 n_children;
+  guint32 capacity;
+  guint32 key; // a byte, or a code point for the _utf8 procedures
+};
+
+struct _PrefixMap
+{
+  PrefixNode *nodes;
+  guint32 n_nodes;
+  guint32 capacity;
+  guint32 free_runs[PREFIX_MAP_N_SIZES];
+  int key_mode;
+
+  guint32 *keys; // only when frozen, keys[i] == nodes[i].key
 };
 
 PrefixMap *prefix_map_new (void);
+PrefixMap *prefix_map_build_sorted_utf8 (const char **keys, void **data, guint n_keys); // the keys must be distinct
+void prefix_map_free (PrefixMap *map); // doesn't touch the data
+void prefix_map_freeze (PrefixMap *map);
 
-void **prefix_map_lookup (PrefixMap *map, const char *key); // returns a pointer to where you can insert, if it's not already there
+void **prefix_map_lookup (PrefixMap *map, const char *key); // returns a pointer to where you can insert, if it's not already there; only good until the next insertion
 void *prefix_map_get (PrefixMap *map, const char *key); // returns NULL if it's not there
 
-void *prefix_map_get_prefix (PrefixMap *map, const char **key);
+void **prefix_map_lookup_utf8 (PrefixMap *map, const char *key);
+void *prefix_map_get_utf8 (PrefixMap *map, const char *key);
+
+// the longest key that starts *key, stopping at end (or the NUL, if end is NULL); *key gets moved past it
+void *prefix_map_get_prefix_utf8 (PrefixMap *map, const char **key, const char *end);
+
+void prefix_map_foreach_utf8 (PrefixMap *map, PrefixMapFunc func, void *userdata); // in key order, only where there's data
 
 #endif
@@ -0,0 +1,81 @@
+#include "scan.h"
+#include <string.h>
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
+#define S SCAN_SPACE
+#define N (SCAN_SPACE | SCAN_NEWLINE)
+#define D SCAN_DIGIT
+
+const guint8 scan_classes[256] =
+  {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, S, N, S, S, S, 0, 0, // \t \n \v \f \r
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    S, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // space
+    D, D, D, D, D, D, D, D, D, D, 0, 0, 0, 0, 0, 0  // 0-9
+    // and nothing else is in any class
+  };
+
+#undef S
+#undef N
+#undef D
+
+/**
+ * Public procedures
+ */
+
+const char *
+scan_line_end (const char *ptr, const char *end)
+{
+  const char *newline = memchr (ptr, '\n', (size_t)(end - ptr));
+  return newline ? newline : end;
+}
+
+const char *
+scan_field_end (const char *ptr, const char *end)
+{
+#if defined(__SSE2__)
+  // a space is 0x20, or 0x09 to 0x0d, which are the bytes b with b - 9 < 5 unsigned
+  const __m128i space = _mm_set1_epi8 (' ');
+  const __m128i tab = _mm_set1_epi8 ('\t');
+  const __m128i four = _mm_set1_epi8 (4);
+  while (end - ptr >= 16)
+  {
+    __m128i bytes = _mm_loadu_si128 ((const __m128i *)(const void *)ptr);
+    __m128i offset = _mm_sub_epi8 (bytes, tab);
+    __m128i control = _mm_cmpeq_epi8 (_mm_min_epu8 (offset, four), offset);
+    int mask = _mm_movemask_epi8 (_mm_or_si128 (control, _mm_cmpeq_epi8 (bytes, space)));
+    if (mask != 0)
+      return ptr + __builtin_ctz ((unsigned int)mask);
+    ptr += 16;
+  }
+#endif
+
+  while (ptr < end && !scan_is_space (*ptr))
+    ++ptr;
+  return ptr;
+}
+
+const char *
+scan_blanks (const char *ptr, const char *end)
+{
+  while (ptr < end && (scan_classes[(guchar)*ptr] & (SCAN_SPACE | SCAN_NEWLINE)) == SCAN_SPACE)
+    ++ptr;
+  return ptr;
+}
+
+const char *
+scan_spaces (const char *ptr, const char *end, int *newlines)
+{
+  // runs of space are short, so this goes a byte at a time
+  for (; ptr < end; ++ptr)
+  {
+    guint8 cls = scan_classes[(guchar)*ptr];
+    if ((cls & SCAN_SPACE) == 0)
+      break;
+    if ((cls & SCAN_NEWLINE) != 0)
+      *newlines += 1;
+  }
+  return ptr;
+}
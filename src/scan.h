@@ -0,0 +1,41 @@
+#ifndef OSX_KB_SCAN_H
+#define OSX_KB_SCAN_H
+
+#include "common.h"
+
+/**
+ * Byte classes and bulk searches for the datafile parsers. Classes come
+ * from a table rather than <ctype.h>, so they're the same in every locale
+ * and any byte can be asked about, including the ones in UTF-8 sequences
+ * (which are never spaces or digits). Space is what isspace means in the C
+ * locale. The searches all stop at end, which they return if they find
+ * nothing, and never read past it.
+ */
+
+enum
+  {
+    SCAN_SPACE = 1 << 0,
+    SCAN_NEWLINE = 1 << 1,
+    SCAN_DIGIT = 1 << 2
+  };
+
+extern const guint8 scan_classes[256];
+
+static inline bool
+scan_is_space (char c)
+{
+  return (scan_classes[(guchar)c] & SCAN_SPACE) != 0;
+}
+
+static inline bool
+scan_is_digit (char c)
+{
+  return (scan_classes[(guchar)c] & SCAN_DIGIT) != 0;
+}
+
+const char *scan_line_end (const char *ptr, const char *end); // the next newline
+const char *scan_field_end (const char *ptr, const char *end); // the next space of any kind
+const char *scan_blanks (const char *ptr, const char *end); // past spaces, but not a newline
+const char *scan_spaces (const char *ptr, const char *end, int *newlines); // past spaces, adding up the newlines
+
+#endif
@@ -0,0 +1,118 @@
+#include "strtable.h"
+#include <string.h>
+
+static guint32 *str_table_find_slot (const StrTable *table, const char *str);
+static void str_table_grow (StrTable *table);
+
+static const guint32 INITIAL_SLOTS = 1024;
+
+/**
+ * Private procedures
+ */
+
+// the slot holding str's id, or the empty slot where it would go
+guint32 *
+str_table_find_slot (const StrTable *table, const char *str)
+{
+  guint32 mask = table->n_slots - 1;
+  for (guint32 idx = g_str_hash (str) & mask; ; idx = (idx + 1) & mask)
+  {
+    guint32 *slot = &table->slots[idx];
+    if (*slot == 0 || strcmp (table->blob + *slot, str) == 0)
+      return slot;
+  }
+}
+
+void
+str_table_grow (StrTable *table)
+{
+  guint32 *old_slots = table->slots;
+  guint32 old_n_slots = table->n_slots;
+
+  table->n_slots *= 2;
+  table->slots = g_new0 (guint32, table->n_slots);
+  for (guint32 idx = 0; idx < old_n_slots; ++idx)
+  {
+    if (old_slots[idx] != 0)
+      *str_table_find_slot (table, table->blob + old_slots[idx]) = old_slots[idx];
+  }
+
+  g_free (old_slots);
+}
+
+/**
+ * Public procedures
+ */
+
+StrTable *
+str_table_new ()
+{
+  StrTable *table = g_slice_alloc0 (sizeof (StrTable));
+
+  table->allocated = 4096;
+  table->blob = g_malloc (table->allocated);
+  table->blob[0] = '\0'; // id 0
+  table->len = 1;
+
+  table->n_slots = INITIAL_SLOTS;
+  table->slots = g_new0 (guint32, table->n_slots);
+
+  return table;
+}
+
+StrTable *
+str_table_copy (const StrTable *src)
+{
+  StrTable *table = g_slice_alloc0 (sizeof (StrTable));
+
+  table->allocated = src->allocated;
+  table->blob = g_malloc (table->allocated);
+  memcpy (table->blob, src->blob, src->len);
+  table->len = src->len;
+
+  // the ids are offsets, so they're just as good in the copied blob
+  table->n_slots = src->n_slots;
+  table->n_ids = src->n_ids;
+  table->slots = g_new (guint32, table->n_slots);
+  memcpy (table->slots, src->slots, table->n_slots * sizeof (guint32));
+
+  return table;
+}
+
+void
+str_table_free (StrTable *table)
+{
+  g_free (table->blob);
+  g_free (table->slots);
+  g_slice_free1 (sizeof (StrTable), table);
+}
+
+guint32
+str_table_intern (StrTable *table, const char *str)
+{
+  g_assert (str != NULL);
+
+  guint32 *slot = str_table_find_slot (table, str);
+  if (*slot != 0)
+    return *slot;
+
+  guint32 size = (guint32)strlen (str) + 1;
+  g_assert (table->len + size <= STR_TABLE_MAX_ID);
+
+  if (table->len + size > table->allocated)
+  {
+    while (table->len + size > table->allocated)
+      table->allocated *= 2;
+    table->blob = g_realloc (table->blob, table->allocated);
+  }
+
+  guint32 new_id = table->len;
+  memcpy (table->blob + new_id, str, size);
+  table->len += size;
+
+  *slot = new_id;
+  if (++table->n_ids * 2 > table->n_slots)
+    str_table_grow (table);
+
+  return new_id;
+}
@@ -0,0 +1,43 @@
+#ifndef OSX_KB_STRTABLE_H
+#define OSX_KB_STRTABLE_H
+
+#include "common.h"
+
+typedef struct _StrTable StrTable;
+
+/**
+ * Interns strings into one contiguous blob, so equal strings always get the
+ * same id (their offset in the blob) and can be compared, hashed, and packed
+ * into arrays as numbers. Id 0 is never given out, and stands for no string
+ * at all. The hash from strings to ids holds only the ids, and reads each
+ * one's string out of the blob, so nothing is stored twice and a copy is
+ * just two memcpys.
+ */
+
+#define STR_TABLE_MAX_ID 0x3fffffff // ids fit in 30 bits
+
+struct _StrTable
+{
+  char *blob; // every string, each followed by its nul
+  guint32 len;
+  guint32 allocated;
+
+  guint32 *slots; // ids, open addressed by their string's hash; 0 is an empty slot
+  guint32 n_slots; // a power of two, at least twice n_ids
+  guint32 n_ids;
+};
+
+StrTable *str_table_new (void);
+StrTable *str_table_copy (const StrTable *src); // the same strings with the same ids
+void str_table_free (StrTable *table);
+
+guint32 str_table_intern (StrTable *table, const char *str);
+
+// only good until the next str_table_intern, which may move the blob
+static inline const char *
+str_table_lookup (const StrTable *table, guint32 id)
+{
+  return table->blob + id;
+}
+
+#endif
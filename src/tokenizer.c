@@ -0,0 +1,153 @@
+#include "tokenizer.h"
+#include <string.h>
+#include "data.h"
+#include "keymap.h"
+
+enum
+  {
+    TOKEN_LITERAL,
+    TOKEN_NAME,
+    TOKEN_MODIFIER
+  };
+
+struct _Token
+{
+  int token_type;
+  int mods;
+  void *literal;
+};
+
+static void count_literal (const char *key, void *literal, int *count);
+static void add_literal (const char *key, void *literal, Tokenizer *tok);
+
+static void tokenizer_add (Tokenizer *tok, const char *key, int token_type, int mods, void *literal);
+
+static bool bad_name (const char *str, const char *close, GError **error);
+
+/**
+ * Private procedures
+ */
+
+void
+count_literal (const char *key, void *literal, int *count)
+{
+  *count += 1;
+}
+
+void
+add_literal (const char *key, void *literal, Tokenizer *tok)
+{
+  tokenizer_add (tok, key, TOKEN_LITERAL, 0, literal);
+}
+
+void
+tokenizer_add (Tokenizer *tok, const char *key, int token_type, int mods, void *literal)
+{
+  Token *token = tok->token_block + tok->n_tokens;
+  tok->n_tokens += 1;
+
+  token->token_type = token_type;
+  token->mods = mods;
+  token->literal = literal;
+
+  // names and modifiers win over any literal spelled the same way
+  *prefix_map_lookup_utf8 (tok->tokens, key) = token;
+}
+
+// str starts with a bracketed name that isn't one of our tokens, and close is its `]'
+bool
+bad_name (const char *str, const char *close, GError **error)
+{
+  const char *name = str + 1;
+  int len = (int)(close - name);
+
+  if (lookup_ascii (name, (gsize)len) == '\0')
+    make_error (error, "Unknown character name `%.*s'", len, name);
+  else
+    make_error (error, "Unknown character `%.*s'", len, name);
+
+  return false;
+}
+
+/**
+ * Public procedures
+ */
+
+Tokenizer *
+tokenizer_new (PrefixMap *literals)
+{
+  Tokenizer *tok = g_slice_alloc0 (sizeof (Tokenizer));
+
+  int n_literals = 0;
+  prefix_map_foreach_utf8 (literals, (PrefixMapFunc)count_literal, &n_literals);
+
+  tok->tokens = prefix_map_new ();
+  tok->token_block = g_malloc ((size_t)(n_literals + N_NAMES + 2) * sizeof (Token));
+
+  prefix_map_foreach_utf8 (literals, (PrefixMapFunc)add_literal, tok);
+
+  for (int idx = 0; idx < N_NAMES; ++idx)
+  {
+    char s[2] = { name_to_ascii[idx].ascii, '\0' };
+    void *literal = prefix_map_get_utf8 (literals, s);
+    if (literal)
+    {
+      char *key = g_strconcat ("[", name_to_ascii[idx].name, "]", NULL);
+      tokenizer_add (tok, key, TOKEN_NAME, 0, literal);
+      g_free (key);
+    }
+  }
+
+  tokenizer_add (tok, "O-", TOKEN_MODIFIER, MOD_OPTION, NULL);
+  tokenizer_add (tok, "C-", TOKEN_MODIFIER, MOD_CONTROL, NULL);
+
+  prefix_map_freeze (tok->tokens);
+
+  return tok;
+}
+
+void
+tokenizer_free (Tokenizer *tok)
+{
+  prefix_map_free (tok->tokens);
+  g_free (tok->token_block);
+  g_slice_free1 (sizeof (Tokenizer), tok);
+}
+
+bool
+tokenizer_next (Tokenizer *tok, const char **str, const char *end, int *mods, void **literal, GError **error)
+{
+  const char *ptr = *str;
+  *mods = 0;
+
+  while (true)
+  {
+    if (ptr == end)
+      return make_error (error, "Truncated key list");
+
+    const char *start = ptr;
+    Token *token = prefix_map_get_prefix_utf8 (tok->tokens, &ptr, end);
+
+    // anything bracketed is a name, even if some literal starts with `['
+    const char *close;
+    if (*start == '[' && (token == NULL || token->token_type != TOKEN_NAME)
+        && (close = memchr (start, ']', (size_t)(end - start))) != NULL)
+    {
+      return bad_name (start, close, error);
+    }
+
+    if (token == NULL)
+      return make_error (error, "Unknown character `%.*s'", (int)(end - start), start);
+
+    if (token->token_type == TOKEN_MODIFIER)
+    {
+      *mods |= token->mods;
+    }
+    else
+    {
+      *literal = token->literal;
+      *str = ptr;
+      return true;
+    }
+  }
+}
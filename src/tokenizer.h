@@ -0,0 +1,30 @@
+#ifndef OSX_KB_TOKENIZER_H
+#define OSX_KB_TOKENIZER_H
+
+#include "common.h"
+#include "prefixmap.h"
+
+typedef struct _Tokenizer Tokenizer;
+typedef struct _Token Token;
+
+/**
+ * Splits key sequences into keys. Every literal, every "[NAME]" alias whose
+ * character is a literal, and the "O-" and "C-" modifier prefixes go into a
+ * single frozen trie, so each key comes out of one left-to-right walk over
+ * the input, taking the longest token at every step.
+ */
+
+struct _Tokenizer
+{
+  PrefixMap *tokens;
+  Token *token_block;
+  int n_tokens;
+};
+
+Tokenizer *tokenizer_new (PrefixMap *literals); // literals should be keyed with the _utf8 procedures
+void tokenizer_free (Tokenizer *tok);
+
+// reads one key (with its modifiers) from *str, not going past end, and advances *str past it
+bool tokenizer_next (Tokenizer *tok, const char **str, const char *end, int *mods, void **literal, GError **error);
+
+#endif
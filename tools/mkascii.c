@@ -34,12 +34,23 @@ static bool handle_xmlspecial (GList *elts, int n_elts, GError **error);
 static bool handle_otherspecial (GList *elts, int n_elts, GError **error);
 static bool handle_control_code (GList *elts, int n_elts, GError **error);
 
-static gboolean map_name_to_ascii (char *name, Ascii *ascii);
+static gboolean map_name_to_ascii (char *name, Ascii *ascii, GPtrArray *names);
 static gboolean map_ascii_to_name (Ascii *ascii, char *name, char **lookup);
 static gboolean map_ascii_to_output (Ascii *ascii, char *output, char **lookup);
 
 static void print_ascii_lookup (const char *name, const char **lookup);
 
+static guint32 hash_name (const char *name, gsize len, guint32 seed);
+static bool print_name_hash (GPtrArray *names, GError **error);
+
+static bool decode_field (const char *field, GString *literal, GError **error);
+static char *literal_output (const char *literal, const char **output_lookup);
+static const char *literal_control (const char *literal, const char *output);
+static GPtrArray *split_fields (char *line);
+static void print_c_string (const char *str);
+static bool print_keys (const char *varname, const char *path, const char **output_lookup, GError **error);
+static bool print_lines (const char *varname, const char *path, const char **output_lookup, GError **error);
+
 bool
 bad_elements (int found, int expected, GError **error)
 {
@@ -187,9 +198,10 @@ handle_control_code (GList *elts, int n_elts, GError **error)
 }
 
 gboolean
-map_name_to_ascii (char *name, Ascii *ascii)
+map_name_to_ascii (char *name, Ascii *ascii, GPtrArray *names)
 {
-  printf ("  { \"%s\", '%s' },\n", name, ascii->display);
+  printf ("  { \"%s\", '%s', %d },\n", name, ascii->display, (int)strlen (name));
+  g_ptr_array_add (names, name);
   return FALSE;
 }
 
@@ -225,6 +237,300 @@ print_ascii_lookup (const char *name, const char **lookup)
   printf (" };\n");
 }
 
+// the same as osxkb's hash_name
+guint32
+hash_name (const char *name, gsize len, guint32 seed)
+{
+  guint32 hash = seed;
+  for (gsize idx = 0; idx < len; ++idx)
+    hash = (hash ^ (guint8)name[idx]) * 16777619u;
+  return hash ^ (hash >> 16);
+}
+
+// finds a seed and a table size with no two names in the same slot
+bool
+print_name_hash (GPtrArray *names, GError **error)
+{
+  // slots hold an index into name_to_ascii plus one, or 0 for none
+  if (names->len > 255)
+  {
+    *error = g_error_new (domain, 0, "too many names for the hash: %u", names->len);
+    return false;
+  }
+
+  guint size = 1;
+  while (size < 2 * names->len)
+    size *= 2;
+
+  for (; size <= 4096; size *= 2)
+  {
+    guint8 *slots = g_malloc (size);
+    for (guint32 seed = 1; seed <= 0xffff; ++seed)
+    {
+      memset (slots, 0, size);
+
+      guint idx;
+      for (idx = 0; idx < names->len; ++idx)
+      {
+        const char *name = g_ptr_array_index (names, idx);
+        guint32 slot = hash_name (name, strlen (name), seed) & (size - 1);
+        if (slots[slot] != 0)
+          break;
+        slots[slot] = (guint8)(idx + 1);
+      }
+      if (idx < names->len)
+        continue;
+
+      printf ("static const guint32 NAME_HASH_SEED = %u;\n\n", seed);
+      printf ("static const guint8 name_hash[%u] = {", size);
+      for (guint slot = 0; slot < size; ++slot)
+        printf ("%s%d,", slot % 16 == 0 ? "\n  " : " ", slots[slot]);
+      printf ("\n};\n\n");
+
+      g_free (slots);
+      return true;
+    }
+    g_free (slots);
+  }
+
+  *error = g_error_new (domain, 0, "no perfect hash found for the names");
+  return false;
+}
+
+// the same as osxkb's parse_input_to_literal
+bool
+decode_field (const char *field, GString *literal, GError **error)
+{
+  g_string_truncate (literal, 0);
+
+  const char *ptr = field;
+  while (*ptr)
+  {
+    const char *close;
+    if (*ptr == '[' && (close = strchr (ptr, ']')) != NULL)
+    {
+      char *name = g_strndup (ptr + 1, (gsize)(close - ptr - 1));
+      Ascii *ascii = g_tree_lookup (name_to_ascii, name);
+      if (ascii == NULL)
+      {
+        *error = g_error_new (domain, 0, "unknown character name `%s'", name);
+        g_free (name);
+        return false;
+      }
+      g_free (name);
+
+      g_string_append_c (literal, (char)ascii->sort);
+      ptr = close + 1;
+    }
+    else
+    {
+      g_string_append_c (literal, *ptr);
+      ++ptr;
+    }
+  }
+
+  return true;
+}
+
+// the same as osxkb's parse_literal_to_output
+char *
+literal_output (const char *literal, const char **output_lookup)
+{
+  GString *output = g_string_new (NULL);
+  for (const char *ptr = literal; *ptr; ++ptr)
+  {
+    if (*ptr > 0 && output_lookup[(int)*ptr])
+      g_string_append (output, output_lookup[(int)*ptr]);
+    else
+      g_string_append_c (output, *ptr);
+  }
+
+  return g_string_free (output, FALSE);
+}
+
+// what a shiftless literal outputs with control, the same as osxkb works it out
+const char *
+literal_control (const char *literal, const char *output)
+{
+  if (literal[0] > 0 && literal[1] == '\0' && ctrl_codes[(int)*literal])
+    return ctrl_codes[(int)*literal];
+  else if (strcmp (literal, "§") == 0)
+    return "0"; // weird special case
+  else
+    return output;
+}
+
+// splits line in place, on the same spaces osxkb does
+GPtrArray *
+split_fields (char *line)
+{
+  GPtrArray *fields = g_ptr_array_new ();
+  char *ptr = line;
+  while (true)
+  {
+    while (isspace ((unsigned char)*ptr))
+      ++ptr;
+    if (*ptr == '\0')
+      break;
+
+    g_ptr_array_add (fields, ptr);
+    while (*ptr && !isspace ((unsigned char)*ptr))
+      ++ptr;
+    if (*ptr)
+      *ptr++ = '\0';
+  }
+
+  return fields;
+}
+
+// octal escapes, so a following digit can't be taken into one
+void
+print_c_string (const char *str)
+{
+  putchar ('"');
+  for (const unsigned char *ptr = (const unsigned char *)str; *ptr; ++ptr)
+  {
+    if (*ptr == '"' || *ptr == '\\')
+      printf ("\\%c", *ptr);
+    else if (*ptr < 0x20 || *ptr >= 0x7f || *ptr == '?')
+      printf ("\\%03o", *ptr);
+    else
+      putchar (*ptr);
+  }
+  putchar ('"');
+}
+
+// a base encoding: code, then the shiftless, shifty and capslock fields
+bool
+print_keys (const char *varname, const char *path, const char **output_lookup, GError **error)
+{
+  char *contents;
+  if (!g_file_get_contents (path, &contents, NULL, error))
+    return false;
+
+  printf ("static const BuiltinKey %s[] = {\n", varname);
+
+  GString *literal = g_string_new (NULL);
+  char **lines = g_strsplit (contents, "\n", -1);
+  for (int idx = 0; lines[idx]; ++idx)
+  {
+    GPtrArray *fields = split_fields (lines[idx]);
+    if (fields->len == 0)
+      continue;
+
+    if (fields->len < 3)
+    {
+      *error = g_error_new (domain, 0, "too few fields (%s, line %d)", path, idx + 1);
+      return false;
+    }
+
+    int code = mkcode (g_ptr_array_index (fields, 0), error);
+    if (code == -1 || code > 127)
+    {
+      g_clear_error (error);
+      *error = g_error_new (domain, 0, "bad key code (%s, line %d)", path, idx + 1);
+      return false;
+    }
+
+    char *literals[3];
+    char *outputs[3];
+    for (guint state = 0; state < 3; ++state)
+    {
+      const char *field = state + 1 < fields->len ? g_ptr_array_index (fields, state + 1) : "";
+      if (!decode_field (field, literal, error))
+      {
+        g_prefix_error (error, "%s, line %d: ", path, idx + 1);
+        return false;
+      }
+      literals[state] = g_strdup (literal->str);
+      outputs[state] = literal_output (literal->str, output_lookup);
+    }
+
+    printf ("  { %d, { ", code);
+    for (int state = 0; state < 3; ++state)
+    {
+      print_c_string (literals[state]);
+      printf (state < 2 ? ", " : " }, { ");
+    }
+    for (int state = 0; state < 3; ++state)
+    {
+      print_c_string (outputs[state]);
+      printf (state < 2 ? ", " : " }, ");
+    }
+    print_c_string (literal_control (literals[0], outputs[0]));
+    printf (" },\n");
+
+    for (int state = 0; state < 3; ++state)
+    {
+      g_free (literals[state]);
+      g_free (outputs[state]);
+    }
+    g_ptr_array_free (fields, TRUE);
+  }
+
+  printf ("};\n\n");
+
+  g_strfreev (lines);
+  g_string_free (literal, TRUE);
+  g_free (contents);
+
+  return true;
+}
+
+// a datafile: the output, then the keys that make it
+bool
+print_lines (const char *varname, const char *path, const char **output_lookup, GError **error)
+{
+  char *contents;
+  if (!g_file_get_contents (path, &contents, NULL, error))
+    return false;
+
+  printf ("static const BuiltinLine %s[] = {\n", varname);
+
+  GString *literal = g_string_new (NULL);
+  char **lines = g_strsplit (contents, "\n", -1);
+  for (int idx = 0; lines[idx]; ++idx)
+  {
+    GPtrArray *fields = split_fields (lines[idx]);
+    if (fields->len == 0)
+      continue;
+
+    if (fields->len < 2)
+    {
+      *error = g_error_new (domain, 0, "missing keys (%s, line %d)", path, idx + 1);
+      return false;
+    }
+
+    if (!decode_field (g_ptr_array_index (fields, 0), literal, error))
+    {
+      g_prefix_error (error, "%s, line %d: ", path, idx + 1);
+      return false;
+    }
+    char *output = literal_output (literal->str, output_lookup);
+
+    g_ptr_array_add (fields, NULL);
+    char *keys = g_strjoinv (" ", (char **)fields->pdata + 1);
+
+    printf ("  { ");
+    print_c_string (output);
+    printf (", ");
+    print_c_string (keys);
+    printf (", %d },\n", idx + 1);
+
+    g_free (keys);
+    g_free (output);
+    g_ptr_array_free (fields, TRUE);
+  }
+
+  printf ("};\n\n");
+
+  g_strfreev (lines);
+  g_string_free (literal, TRUE);
+  g_free (contents);
+
+  return true;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -234,7 +540,8 @@ main (int argc, char **argv)
   ascii_to_name = g_tree_new ((GCompareFunc)asciis_compare);
   ascii_to_output = g_tree_new ((GCompareFunc)asciis_compare);
   
-  if (argc != 2)
+  // the ascii file, then any built-in data: --keys or --lines, a variable name and a file
+  if (argc < 2 || argc % 3 != 2)
   {
     fprintf (stderr, "%s: bad command line\n", argv[0]);
     return 1;
@@ -343,13 +650,21 @@ main (int argc, char **argv)
 
   printf ("static const AsciiLookup name_to_ascii[] = {\n");
   
-  g_tree_foreach (name_to_ascii, (GTraverseFunc)map_name_to_ascii, NULL);
+  GPtrArray *names = g_ptr_array_new ();
+  g_tree_foreach (name_to_ascii, (GTraverseFunc)map_name_to_ascii, names);
 
   printf ("};\n"
           "\n"
           "static const int N_NAMES = %d;\n\n",
           g_tree_nnodes (name_to_ascii));
 
+  if (!print_name_hash (names, &error))
+  {
+    fprintf (stderr, "%s: %s\n", argv[0], error->message);
+    return 1;
+  }
+  g_ptr_array_free (names, TRUE);
+
   const char *name_lookup[128] = { NULL, };
   g_tree_foreach (ascii_to_name, (GTraverseFunc)map_ascii_to_name, name_lookup);
 
@@ -361,6 +676,26 @@ main (int argc, char **argv)
   print_ascii_lookup ("control_codes", ctrl_codes);
   printf ("\n");
 
+  for (int idx = 2; idx < argc; idx += 3)
+  {
+    bool ok;
+    if (strcmp (argv[idx], "--keys") == 0)
+      ok = print_keys (argv[idx + 1], argv[idx + 2], output_lookup, &error);
+    else if (strcmp (argv[idx], "--lines") == 0)
+      ok = print_lines (argv[idx + 1], argv[idx + 2], output_lookup, &error);
+    else
+    {
+      fprintf (stderr, "%s: bad command line\n", argv[0]);
+      return 1;
+    }
+
+    if (!ok)
+    {
+      fprintf (stderr, "%s: %s\n", argv[0], error->message);
+      return 1;
+    }
+  }
+
   return 0;  
 }
 